@@ -13,19 +13,89 @@
 #include <time.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /***macros ***/
 #define CTRL_KEY(k)((k) &0x1f)
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 #define KILO_VERSION "0.0.1"
 #define TAB_STOP 8
 #define QUIT_TIMES 3
 #define HIGHLIGHT_NUMBERS (1 << 0)
 #define HIGHLIGHT_STRINGS (1 << 1)
+#define HIGHLIGHT_NESTED_COMMENTS (1 << 2)
+#define LEX_SEPARATOR (1 << 0)
+#define LEX_DIGIT (1 << 1)
+#define LEX_DOT (1 << 2)
+#define LEX_QUOTE (1 << 3)
+#define LEX_OPEN (1 << 4)
+#define LEX_KEYWORD (1 << 5)
+#define LEX_STOP (LEX_SEPARATOR | LEX_DIGIT | LEX_DOT | LEX_QUOTE | LEX_OPEN)
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+#define CONFIG_DIR "pretty"
+#define SYNTAX_DIR "syntax"
+#define SYNTAX_SUFFIX ".syntax"
+#define SYNTAX_CACHE "syntax.cache"
+#define SYNTAX_CACHE_MAGIC "PRTYSYN"
+#define SYNTAX_CACHE_VERSION 1
+#define ADD_BLOCK_SIZE (64 * 1024)
+#define ROWS_PER_LEAF 64
+#define ROWTREE_FANOUT 32
+#define LOAD_CHUNK_ROWS 4096
+#define LOAD_PREFETCH_BYTES (1024 * 1024)
+#define ROW_DIRTY (1 << 0)
+#define RENDER_CACHE_BUDGET (32 * 1024 * 1024)
+#define HL_FRAME_ROWS 2000
+#define HL_INLINE_ROWS 64
+#define HL_JOB_ROWS 1024
+#define CELL_INVERSE 0x80
+#define FRAME_SPAN_GAP 4
+#define FRAME_INTERVAL (1.0 / 60)
+#define INPUT_BUF_SIZE (64 * 1024)
+#define INPUT_SEQ_MAX 8
+#define INPUT_WAIT_MS 100
+#define STATUS_MSG_SECONDS 5
+#define LOAD_WAKE_INTERVAL 0.1
+#define PASTE_END_SEQ "\x1b[201~"
+#define PASTE_IDLE_SECONDS 1.0
+#define BENCH_ROWS 60
+#define BENCH_COLS 250
+#define BENCH_FRAMES 2000
+#define BENCH_PAGES 16
+#define BENCH_LEX_BYTES (256 * 1024 * 1024)
+#define BENCH_SEARCH_MISS "no\x7fmatch"
+#define SEARCH_MATCH_MAX (2 * 1024 * 1024)
+#define SEARCH_CHUNK_ROWS 8192
+#define SEARCH_THREADS_MAX 16
+#define REGEX_DEPTH_MAX 256
+#define REGEX_REPEAT_MAX 1000
+#define REGEX_NFA_MAX 20000
+#define DFA_STATES_MAX 4096
+#define BENCH_REGEX_LITERAL "no\x7fmatch [0-9]+ms"
+#define BENCH_REGEX_DFA "[\x01\x02][0-9]+[a-z]"
+#define CHECK_FILE "/tmp/pretty-check-XXXXXX"
+#define CHECK_TEXT "alpha\nbanana\ncab\n"
+#define UNDO_MEMORY_MAX (64 * 1024 * 1024)
+#define UNDO_MEMORY_ENV "PRETTY_UNDO_MB"
+#define UNDO_COALESCE_MAX 4096
+#define UNDO_FIRST (1 << 0)
+#define UNDO_REF (1 << 1)
+#define UNDO_NOT_SAVED ((size_t) -1)
+#define UNDO_PAD(n) (((n) + 7) & ~7)
 
 /***enums ***/
 enum editorKey
@@ -39,7 +109,37 @@ enum editorKey
 		HOME_KEY,
 		END_KEY,
 		PAGE_UP,
-		PAGE_DOWN
+		PAGE_DOWN,
+		PASTE_START,
+		PASTE_END
+};
+
+enum regexOp
+{
+	RE_SET = 0,
+		RE_BOT,
+		RE_EOT,
+		RE_EMPTY,
+		RE_CAT,
+		RE_ALT,
+		RE_REPEAT
+};
+
+enum nfaOp
+{
+	NFA_SET = 0,
+		NFA_SPLIT,
+		NFA_BOT,
+		NFA_EOT,
+		NFA_MATCH
+};
+
+enum undoOp
+{
+	UNDO_INSERT = 0,
+		UNDO_DELETE,
+		UNDO_SPLIT,
+		UNDO_JOIN
 };
 
 enum editorHighlight
@@ -59,21 +159,304 @@ struct abuf
 {
 	char *b;
 	int len;
+	int cap;
+};
+
+struct editorStats
+{
+	unsigned long frames;
+	unsigned long allocs;
+	unsigned long frame_allocs;
+	unsigned long frame_bytes;
+	unsigned long keys;
+	unsigned long frame_keys;
+	double wait;
+	double frame_at;
+	double frame_render;
+	double frame_input;
+};
+
+struct cells
+{
+	unsigned char *ch;
+	unsigned char *attr;
+};
+
+struct frame
+{
+	struct cells shown;
+	struct cells next;
+	int rows;
+	int cols;
+	int rowoff;
+	int coloff;
+	bool valid;
+};
+
+struct sgr
+{
+	char seq[12];
+	int len;
+};
+
+struct input
+{
+	char buf[INPUT_BUF_SIZE];
+	unsigned int head;
+	unsigned int tail;
+};
+
+struct piece
+{
+	const char *data;
+	int len;
+};
+
+struct addblock
+{
+	struct addblock *next;
+	int len;
+	int cap;
+	char data[];
+};
+
+struct textbuf
+{
+	char *orig;
+	size_t origlen;
+	size_t indexed;
+	bool mapped;
+	struct addblock *add;
+};
+
+struct match
+{
+	int row;
+	int cx;
+	int len;
+	int room;
+	const char *text;
+};
+
+struct matchset
+{
+	struct match *m;
+	int n;
+	int cap;
+};
+
+struct searchchunk
+{
+	struct matchset found;
+	bool full;
+	bool done;
+};
+
+struct searchpool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	bool started;
+	int nthreads;
+	int busy;
+	int first;
+	int last;
+	int nchunks;
+	int next;
+	int collected;
+	struct searchchunk *chunks;
+};
+
+struct renode
+{
+	unsigned char op;
+	int left;
+	int right;
+	int set;
+	int min;
+	int max;
+};
+
+struct nfastate
+{
+	unsigned char op;
+	int out;
+	int out1;
+	int set;
+};
+
+struct regex
+{
+	char *source;
+	const char *error;
+	bool nocase;
+	int root;
+	struct renode *nodes;
+	int nnodes;
+	int nodecap;
+	unsigned char (*sets)[32];
+	int nsets;
+	int setcap;
+	struct nfastate *nfa;
+	int nnfa;
+	int nfacap;
+	int start[2];
+	unsigned char cls[256];
+	unsigned char rep[256];
+	int nclasses;
+};
+
+struct dfa
+{
+	const struct regex *re;
+	int entry;
+	bool floating;
+	int stride;
+	int nstates;
+	int cap;
+	int *trans;
+	int *setoff;
+	int *setlen;
+	int *pool;
+	int poolused;
+	int poolcap;
+	int *hash;
+	int hashcap;
+	int *scratch;
+	int nscratch;
+	int *stack;
+	int *mark;
+	int gen;
+	int resets;
+	int begin[2];
+};
+
+struct regexscan
+{
+	struct dfa forward;
+	struct dfa reverse;
+	int *marks;
+	int nmarks;
+	int markcap;
+};
+
+struct undorec
+{
+	unsigned char op;
+	unsigned char flags;
+	unsigned short back;
+	int row;
+	int cx;
+	int len;
+};
+
+struct undolog
+{
+	char *buf;
+	size_t cap;
+	size_t limit;
+	size_t start;
+	size_t group;
+	size_t at;
+	size_t len;
+	size_t saved;
+	int prev;
+	unsigned long key;
+	unsigned long lastkey;
+	bool replaying;
+	bool overflow;
+};
+
+struct search
+{
+	char *needle;
+	int len;
+	bool nocase;
+	bool regex;
+	struct regex re;
+	char *query;
+	struct matchset set;
+	struct match from;
+	int current;
+	int scanned;
+	bool valid;
+	bool partial;
+	bool replacing;
+	struct searchpool pool;
+	char prompt[128];
 };
 
+struct lexstate
+{
+	unsigned char comment;
+	unsigned char string;
+};
+
+struct hljob
+{
+	struct hljob *next;
+	unsigned long seq;
+	int gen;
+	struct editorSyntax *syntax;
+	int first;
+	int nrows;
+	bool viewport;
+	int *offsets;
+	char *text;
+	unsigned char *hl;
+	struct lexstate *states;
+};
+
+struct hlworker
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct hljob *todo;
+	struct hljob *done;
+	bool running;
+};
+
+struct rowleaf;
+
 typedef struct erow
 {
-	int idx;
+	struct rowleaf *leaf;
 	int size;
 	int rsize;
-	char *chars;
+	int npieces;
+	int piececap;
+	struct piece *pieces;
+	struct piece piece;
 	char *render;
 	unsigned char *hl;
-	bool hl_open_comment;
+	unsigned char flags;
+	struct lexstate hl_in;
+	struct lexstate hl_out;
+	int hl_gen;
+	unsigned long hl_seq;
 }
 
 erow;
 
+struct rowleaf
+{
+	struct rownode *parent;
+	struct rowleaf *prev;
+	struct rowleaf *next;
+	int count;
+	erow rows[ROWS_PER_LEAF];
+};
+
+struct rownode
+{
+	struct rownode *parent;
+	int nchild;
+	bool leaves;
+	int counts[ROWTREE_FANOUT];
+	void *child[ROWTREE_FANOUT];
+};
+
 struct editorConfig
 {
 	int cx, cy;
@@ -84,14 +467,93 @@ struct editorConfig
 	int screencols;
 	int numrows;
 	int dirty;
-	char statusmsg[80];
+	char statusmsg[128];
 	time_t statusmsg_timestamp;
-	erow * row;
+	bool statusmsg_shown;
+	struct rownode *rowroot;
+	struct textbuf text;
+	struct frame frame;
+	struct input input;
+	struct sgr sgr[256];
+	struct abuf out;
+	struct editorStats stats;
+	pthread_mutex_t lock;
+	int wakefd[2];
+	volatile sig_atomic_t resized;
+	bool loading;
+	bool load_shown;
+	bool rows_pinned;
+	pthread_cond_t rows_unpinned;
+	int hl_gen;
+	int hl_frontier;
+	int hl_budget;
+	bool hl_behind;
+	struct hlworker hlw;
+	unsigned long hl_seq;
+	bool hl_viewport_queued;
+	bool hl_background_queued;
+	int hl_plain_first;
+	int hl_plain_last;
+	struct editorSyntax *hldb;
+	int nsyntaxes;
+	struct search search;
+	struct undolog undo;
+	size_t cache_bytes;
 	char *filename;
 	struct editorSyntax * syntax;
 	struct termios original_termios;
 };
 
+struct kwtrie
+{
+	int nnodes;
+	int width;
+	unsigned char cls[256];
+	int *trans;
+	unsigned char *accept;
+};
+
+struct lexer
+{
+	unsigned char cls[256];
+	char close[2];
+	int scs_len;
+	int mcs_len;
+	int mcs2_len;
+	int mce_len;
+	bool comments;
+	bool nested;
+};
+
+struct syntaxcache
+{
+	char magic[8];
+	int version;
+	int recsize;
+	int nsyntaxes;
+	int nfiles;
+	long long stamp;
+	size_t len;
+};
+
+struct syntaxrecord
+{
+	int filetype;
+	int filematch;
+	int nfilematch;
+	int scs;
+	int mcs;
+	int mcs2;
+	int mce;
+	int flags;
+	int nnodes;
+	int width;
+	int trans;
+	int accept;
+	unsigned char cls[256];
+	struct lexer lexer;
+};
+
 struct editorSyntax
 {
 	char *filetype;
@@ -102,11 +564,19 @@ struct editorSyntax
 	char *multi_comment_start2;
 	char *multi_comment_end;
 	int flags;
+	struct kwtrie *trie;
+	struct lexer *lexer;
 };
 
 /***globals ***/
 
 struct editorConfig editor;
+const bool separators[256] = {
+	['\0'] = true, [' '] = true, ['\t'] = true, ['\n'] = true, ['\v'] = true, ['\f'] = true,
+	['\r'] = true, [','] = true, ['.'] = true, ['('] = true, [')'] = true, ['+'] = true,
+	['-'] = true, ['/'] = true, ['*'] = true, ['='] = true, ['~'] = true, ['%'] = true,
+	['<'] = true, ['>'] = true, ['['] = true, [']'] = true, [';'] = true
+};
 char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL
 };
 char *C_HL_keywords[] = { "switch", "if", "while", "for", "break", "continue", "return", "else",
@@ -121,33 +591,197 @@ struct editorSyntax HLDB[] = {
 		C_HL_extensions,
 		C_HL_keywords,
 		"//", "/*", "/**", "*/",
-		HIGHLIGHT_NUMBERS | HIGHLIGHT_STRINGS
+		HIGHLIGHT_NUMBERS | HIGHLIGHT_STRINGS,
+		NULL,
+		NULL
 	},
 };
 
 /***function signatures ***/
 void editorRefreshScreen(void);
+void editorDrawMatches(erow *row, int at, unsigned char *hl, int len, int *next);
 int editorReadKey(void);
+int editorReadKeyUnlocked(void);
+int editorInputFill(int timeout);
+int editorInputDecode(int *key, bool flush);
+char *editorInputPaste(int *lenp);
+void editorPaste(void);
+void editorInsertText(const char *s, int len);
+void editorInsertStored(const char *stored, int len);
+void editorDeleteText(int at, int cx, int len);
+void editorUndoRecord(int op, int row, int cx, const char *text, int len, bool ref);
+bool editorUndoActive(void);
+bool editorUndoCoalesce(int op, int row, int cx, char c);
+bool editorUndoReserve(int size);
+int editorUndoSize(const struct undorec *rec);
+const char *editorUndoText(const struct undorec *rec);
+void editorUndo(void);
+void editorRedo(void);
+void editorUndoDone(void);
+void editorUndoApply(const struct undorec *rec, bool undo);
+void editorUndoSaved(void);
+void editorUndoRebase(void);
+bool editorInputPending(void);
+void editorLock(void);
+void editorUnlock(void);
 int getCursorPosition(int *rows, int *cols);
 void abAppend(struct abuf *ab, const char *s, int len);
+void abAppendByte(struct abuf *ab, char c);
+char *abReserve(struct abuf *ab, int len);
+void abReset(struct abuf *ab);
 void abFree(struct abuf *ab);
 void editorMoveCursor(int key);
+void editorProcessInput(void);
 void editorOpen(char *filename);
-void editorInsertRow(int at, char *string, size_t len);
+void editorIndexRows(int upto);
+void editorLoadStart(void);
+void editorRowInit(erow *row, const char *string, size_t len);
+erow *editorRowTreeInsert(int at);
+bool editorRowEnsure(erow *row, bool lazy);
+void editorHlStart(void);
+void *editorHlThread(void *arg);
+void editorHlQueue(int first, int nrows, bool viewport);
+void editorHlCollect(void);
+void editorHlApply(struct hljob *job);
+void editorHlSchedule(void);
+void editorHlJobFree(struct hljob *job);
+void editorRowRender(erow *row);
+void editorRowDropCache(erow *row);
+void editorCacheTrim(void);
+void editorInsertRow(int at, const char *string, size_t len);
 void editorUpdateRow(erow *row);
-void editorDrawStatusBar(struct abuf *ab);
+void editorUpdateRowAt(erow *row, int at);
+int editorRowCxStep(erow *row, int *k, int *j, int rx, int n);
+void editorDrawStatusBar(void);
 void editorSetStatusMessage(const char *fmt, ...);
-void editorDrawMessageBar(struct abuf *ab);
+void editorShowStats(void);
+void editorDrawMessageBar(void);
+void editorFramePut(int y, int x, const char *s, int len, unsigned char attr);
+void editorFrameBegin(void);
+void editorFrameFlush(struct abuf *ab);
+void editorFrameScroll(struct abuf *ab);
+void editorBuildSgrTable(void);
+void editorUpdateWindowSize(void);
+double editorClock(void);
+void editorEventInit(void);
+void editorWake(char why);
+void editorHandleWinch(int sig);
+int editorEventTimeout(void);
+void editorHandleEvents(void);
+int editorBench(char *filename);
+void editorBenchSearch(void);
+double editorBenchLex(void (*lex)(struct editorSyntax *, const char *, int, unsigned char *, \
+	const struct lexstate *, struct lexstate *), const char *text, const int *offsets, int nrows, \
+	unsigned char *hl, int passes);
+int editorCheck(void);
 void editorInsertNewLine(void);
+bool editorCursorLoaded(void);
 void editorRowInsertChar(erow *row, int at, int c);
+const char *editorTextAppend(const char *s, int len);
+char *editorTextReserve(int len);
+struct piece *editorRowPieces(erow *row);
+void editorRowInsertPieces(erow *row, int k, const struct piece *src, int n);
+void editorRowTruncate(erow *row, int at);
+void editorRowTreeInit(void);
+erow *editorRowAt(int at);
+int editorRowIndex(erow *row);
+erow *editorRowNext(erow *row);
+erow *editorRowPrev(erow *row);
 void editorDelChar(void);
 void editorInsertChar(int ch);
-char *editorRowsToString(int *buflen);
+char *editorRowsToString(size_t *buflen);
+bool editorWriteAll(int fd, const char *buf, size_t len);
+bool editorSaveTemp(const char *path, const struct stat *st, const char *buf, size_t len);
+bool editorSaveInPlace(const char *path, const char *buf, size_t len);
 void editorSave(void);
 char *editorPrompt(char *prompt, void(*callback)(char *, int));
 void editorUpdateSyntax(erow *row);
+void editorLexRow(struct editorSyntax *syntax, const char *render, int rsize, unsigned char *hl, \
+	const struct lexstate *in, struct lexstate *out);
+void editorLexRowBytewise(struct editorSyntax *syntax, const char *render, int rsize, unsigned char *hl, \
+	const struct lexstate *in, struct lexstate *out);
+struct lexer *editorLexerCompile(struct editorSyntax *syntax);
+int editorLexScan(const char *s, int len, char a, char b);
+bool editorLexAt(const char *render, int rsize, int at, const char *delim, int len);
+void editorLexStateIn(struct lexstate *state, erow *prev);
+struct kwtrie *editorTrieCompile(char **keywords);
+int editorTrieMatch(const struct kwtrie *t, const char *s, unsigned char *hlclass);
 int editorSyntaxToColor(int hl);
 void editorSelectSyntaxHighlight(void);
+void editorSyntaxLoad(void);
+void editorSearchCompile(const char *query);
+void editorSearchPrompt(void);
+void editorReplaceAll(const char *with);
+const char *editorSearchMem(const char *hay, size_t len);
+void editorSearchUpdate(const char *query);
+bool editorSearchEqual(const char *p);
+bool editorSearchAdd(struct matchset *set, int row, int cx, int len, int room, const char *text);
+const char *editorSearchRowText(erow *row, struct abuf *text);
+bool editorSearchRow(erow *row, int at, struct matchset *set, struct regexscan *rs);
+bool editorSearchScan(int start, int stop, struct matchset *set);
+bool editorSearchRows(int start, int stop, struct matchset *set, struct regexscan *rs);
+void editorSearchNarrow(void);
+void editorSearchShow(void);
+bool editorSearchPoolStart(void);
+void *editorSearchThread(void *arg);
+void editorSearchStart(int first);
+void editorSearchCancel(void);
+bool editorSearchCollect(void);
+void editorSearchPick(void);
+int editorSearchFirst(int row, int cx);
+void editorSearchWait(void);
+bool editorRegexCompile(struct regex *re, const char *pattern, bool nocase);
+void editorRegexFree(struct regex *re);
+int editorRegexNode(struct regex *re, int op, int left, int right);
+int editorRegexSet(struct regex *re);
+void editorRegexSetAdd(struct regex *re, int node, int lo, int hi);
+bool editorRegexEscape(struct regex *re, int node, int c);
+int editorRegexAlt(struct regex *re, const char **p, int depth);
+int editorRegexCat(struct regex *re, const char **p, int depth);
+int editorRegexRepeat(struct regex *re, const char **p, int depth);
+bool editorRegexBraces(const char **p, int *min, int *max);
+int editorRegexAtom(struct regex *re, const char **p, int depth);
+bool editorRegexPosix(struct regex *re, int node, const char **p);
+int editorRegexClass(struct regex *re, const char **p);
+void editorRegexClasses(struct regex *re);
+int editorRegexState(struct regex *re, int op, int out, int out1, int set);
+int editorRegexEmit(struct regex *re, int node, int next, bool reverse);
+char *editorRegexLiteral(struct regex *re);
+void editorRegexRequired(struct regex *re, int node, struct abuf *best);
+void editorRegexFactors(struct regex *re, int node, struct abuf *run, struct abuf *best);
+void editorRegexKeep(struct abuf *run, struct abuf *best);
+int editorRegexSingle(struct regex *re, int set);
+void editorDfaInit(struct dfa *d, const struct regex *re, bool reverse);
+void editorDfaFree(struct dfa *d);
+void editorDfaReset(struct dfa *d);
+unsigned int editorDfaHash(const int *set, int n);
+void editorDfaGrow(struct dfa *d);
+int editorDfaIntern(struct dfa *d, const int *set, int n);
+int editorDfaCompare(const void *a, const void *b);
+void editorDfaClosure(struct dfa *d, int id, int pass);
+void editorDfaClear(struct dfa *d);
+int editorDfaSettle(struct dfa *d);
+int editorDfaStep(struct dfa *d, int st, int c);
+int editorDfaNext(struct dfa *d, int at, int c);
+int editorDfaBegin(struct dfa *d, bool bot);
+void editorRegexScanInit(struct regexscan *rs, const struct regex *re);
+void editorRegexScanFree(struct regexscan *rs);
+bool editorRegexRow(struct regexscan *rs, const char *text, int size, int at, bool inpiece, \
+	struct matchset *set);
+void editorRegexMark(struct regexscan *rs, int i);
+int editorRegexLongest(struct dfa *d, const unsigned char *t, int size, int start);
+bool editorRowInOrig(erow *row);
+char *editorConfigPath(const char *name);
+int editorSyntaxScan(const char *dir, char ***names, long long *stamp);
+struct editorSyntax *editorSyntaxParse(const char *path);
+void editorSyntaxAddWord(char ***list, const char *word, bool type);
+void editorSyntaxFree(struct editorSyntax *s);
+void editorSyntaxSerialize(struct abuf *ab, struct editorSyntax **syn, int n, int nfiles, long long stamp);
+int editorCacheData(struct abuf *ab, const void *p, int len);
+bool editorCacheTable(size_t len, int off, size_t count, size_t size);
+ssize_t editorCacheString(const char *base, size_t len, int off);
+bool editorCacheDelim(const char *base, size_t len, int off, int dlen);
+int editorSyntaxMap(const char *base, size_t len, int nfiles, long long stamp);
 
 /***functions ***/
 
@@ -176,6 +810,8 @@ void die(const char *msg)
  */
 void disableRawMode(void)
 {
+	write(STDOUT_FILENO, "\x1b[?2004l", 8);
+
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &editor.original_termios) == -1)
 	{
 		die("tcsetattr");
@@ -206,13 +842,17 @@ void enableRawMode(void)
 	raw.c_oflag &= ~(OPOST);
 	raw.c_cflag |= (CS8);
 	raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+	// reads never wait, the event loop polls before reading
 	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
+	raw.c_cc[VTIME] = 0;
 
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
 	{
 		die("tcsetattr");
 	}
+
+	// have pastes arrive bracketed so they can be inserted in one go
+	write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 /**
@@ -253,6 +893,8 @@ int getWindowSize(int *rows, int *cols)
  */
 void initEditor(void)
 {
+	const char *env;
+
 	editor.cx = 0;
 	editor.cy = 0;
 	editor.rx = 0;
@@ -260,12 +902,58 @@ void initEditor(void)
 	editor.rowoff = 0;
 	editor.numrows = 0;
 	editor.dirty = 0;
-	editor.row = NULL;
+	editorRowTreeInit();
 	editor.filename = NULL;
 	editor.statusmsg[0] = '\0';
 	editor.statusmsg_timestamp = 0;
+	editor.statusmsg_shown = false;
+	editor.wakefd[0] = -1;
+	editor.wakefd[1] = -1;
+	editor.resized = 0;
 	editor.syntax = NULL;
+	editor.loading = false;
+	editor.load_shown = false;
+	editor.rows_pinned = false;
+	editor.hl_gen = 0;
+	editor.hl_frontier = 0;
+	editor.hl_budget = HL_FRAME_ROWS;
+	editor.hl_behind = false;
+	editor.hl_seq = 0;
+	editor.hl_viewport_queued = false;
+	editor.hl_background_queued = false;
+	editor.hl_plain_first = -1;
+	editor.hl_plain_last = -1;
+	memset(&editor.search, 0, sizeof(editor.search));
+	editor.search.current = -1;
+	memset(&editor.undo, 0, sizeof(editor.undo));
+	editor.undo.limit = UNDO_MEMORY_MAX;
+	if ((env = getenv(UNDO_MEMORY_ENV)) != NULL && atol(env) > 0)
+	{
+		editor.undo.limit = (size_t) atol(env) * 1024 * 1024;
+	}
+
+	editorSyntaxLoad();
+	memset(&editor.hlw, 0, sizeof(editor.hlw));
+	editor.cache_bytes = 0;
+	editor.out = (struct abuf) ABUF_INIT;
+	editorBuildSgrTable();
+	memset(&editor.stats, 0, sizeof(editor.stats));
+
+	// main holds the editor lock except while waiting for input
+	pthread_mutex_init(&editor.lock, NULL);
+	pthread_cond_init(&editor.rows_unpinned, NULL);
+	editorLock();
+}
 
+/**
+ *	editorUpdateWindowSize
+ *
+ *	@param none
+ *
+ *	Query the terminal size, leaving room for the status and message bars
+ */
+void editorUpdateWindowSize(void)
+{
 	if (getWindowSize(&editor.screenrows, &editor.screencols) == -1)
 	{
 		die("getWindowSize");
@@ -277,18 +965,30 @@ void initEditor(void)
 /**
  *	editorDrawStatusBar
  *	
- * 	@param ab buffer
+ * 	@param none
  *
+ *	Compose the inverted status line into the frame
  */
-void editorDrawStatusBar(struct abuf *ab)
+void editorDrawStatusBar(void)
 {
-	int len = 0, rlen;
-	char status[80], rstatus[80];
+	int len = 0, rlen, y = editor.screenrows;
+	char status[80], rstatus[80], progress[24];
+
+	editor.load_shown = editor.loading;
+	if (editor.loading)
+	{
+		snprintf(progress, sizeof(progress), " (loading %d%%)", \
+			(int) (editor.text.indexed * 100 / editor.text.origlen));
+	}
+	else
+	{
+		progress[0] = '\0';
+	}
 
-	abAppend(ab, "\x1b[7m", 4);
-	len = snprintf(status, sizeof(status), "%.20s - %d lines %s", \
+	len = snprintf(status, sizeof(status), "%.20s - %d%s lines%s %s", \
 		(editor.filename != NULL) ? editor.filename : "[Untitled]", editor.numrows, \
-		 editor.dirty ? "(modified)" : "");
+		(editor.text.indexed < editor.text.origlen) ? "+" : "", progress, \
+		editor.dirty ? "(modified)" : "");
 	rlen = snprintf(rstatus, sizeof(rstatus), " %s | %d/%d", \
 		editor.syntax ? editor.syntax->filetype : "no filetype", editor.cy + 1, editor.numrows);
 	if (len > editor.screencols)
@@ -296,48 +996,61 @@ void editorDrawStatusBar(struct abuf *ab)
 		len = editor.screencols;
 	}
 
-	abAppend(ab, status, len);
+	editorFramePut(y, 0, status, len, CELL_INVERSE);
 
 	while (len < editor.screencols)
 	{
 		if (editor.screencols - len == rlen)
 		{
-			abAppend(ab, rstatus, rlen);
+			editorFramePut(y, len, rstatus, rlen, CELL_INVERSE);
 			break;
 		}
 		else
 		{
-			abAppend(ab, " ", 1);
+			editorFramePut(y, len, " ", 1, CELL_INVERSE);
 			len++;
 		}
 	}
-
-	abAppend(ab, "\x1b[m", 3);
-	abAppend(ab, "\r\n", 3);
 }
 
 /**
  *	editorDrawMessageBar
  *	
- * 	@param ab buffer
+ * 	@param none
  *
  */
-void editorDrawMessageBar(struct abuf *ab)
+void editorDrawMessageBar(void)
 {
 	int msglen = strlen(editor.statusmsg);
-	abAppend(ab, "\x1b[K", 3);
 
 	if (msglen > editor.screencols)
 	{
 		msglen = editor.screencols;
 	}
 
-	if ((msglen > 0) && (time(NULL) - editor.statusmsg_timestamp < 5))
+	editor.statusmsg_shown = (msglen > 0) && (time(NULL) - editor.statusmsg_timestamp < STATUS_MSG_SECONDS);
+	if (editor.statusmsg_shown)
 	{
-		abAppend(ab, editor.statusmsg, msglen);
+		editorFramePut(editor.screenrows + 1, 0, editor.statusmsg, msglen, HL_NORMAL);
 	}
 }
 
+/**
+ *	editorShowStats
+ *	
+ * 	@param none
+ *
+ *	Report rendering counters in the message bar
+ */
+void editorShowStats(void)
+{
+	struct editorStats *st = &editor.stats;
+
+	editorSetStatusMessage("frames %lu | last frame: %lu allocs, %lu bytes, draw %.2f ms | " \
+		"input %.2f ms for %lu keys | cache %zuK", st->frames, st->frame_allocs, st->frame_bytes, \
+		st->frame_render * 1e3, st->frame_input * 1e3, st->frame_keys, editor.cache_bytes / 1024);
+}
+
 /**
  *	editorSetStatusMessage
  *	
@@ -362,16 +1075,43 @@ void editorSetStatusMessage(const char *fmt, ...)
  */
 int editorRowCxToRx(erow *row, int cx)
 {
-	int rx = 0, j;
+	int k = 0, j = 0;
+
+	return editorRowCxStep(row, &k, &j, 0, cx);
+}
+
+/**
+ *	editorRowCxStep
+ *
+ *	@param row editor row
+ *	@param k piece the walk is at, updated
+ *	@param j offset in that piece, updated
+ *	@param rx render position the walk is at
+ *	@param n number of chars to step over
+ *
+ *	Walk n chars further along the row and return the render position
+ *	reached, so positions in order can be mapped in one pass
+ */
+int editorRowCxStep(erow *row, int *k, int *j, int rx, int n)
+{
+	struct piece *p = editorRowPieces(row);
 
-	for (j = 0; j < cx; j++)
+	for (; *k < row->npieces && n > 0; (*k)++, *j = 0)
 	{
-		if (row->chars[j] == '\t')
+		for (; *j < p[*k].len && n > 0; (*j)++, n--)
 		{
-			rx += (TAB_STOP - 1) - (rx % TAB_STOP);
+			if (p[*k].data[*j] == '\t')
+			{
+				rx += (TAB_STOP - 1) - (rx % TAB_STOP);
+			}
+
+			rx++;
 		}
 
-		rx++;
+		if (n == 0)
+		{
+			break;
+		}
 	}
 
 	return rx;
@@ -387,1486 +1127,8252 @@ int editorRowCxToRx(erow *row, int cx)
 int editorRowRxToCx(erow *row, int rx)
 {
 	int cur_rx = 0;
-	int cx;
+	int cx = 0, j, k;
+	struct piece *p = editorRowPieces(row);
 
-	for (cx = 0; cx < row->size; cx++)
+	for (k = 0; k < row->npieces; k++)
 	{
-		if (row->chars[cx] == '\t')
+		for (j = 0; j < p[k].len; j++, cx++)
 		{
-			cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
-		}
+			if (p[k].data[j] == '\t')
+			{
+				cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
+			}
 
-		cur_rx++;
+			cur_rx++;
 
-		if (cur_rx > rx)
-		{
-			return cx;
+			if (cur_rx > rx)
+			{
+				return cx;
+			}
 		}
 	}
 
 	return cx;
 }
 
+/**
+ *	editorLock
+ *
+ *	@param none
+ *
+ *	Take the lock that guards rows and text against the loader thread
+ */
+void editorLock(void)
+{
+	pthread_mutex_lock(&editor.lock);
+}
+
+/**
+ *	editorUnlock
+ *
+ *	@param none
+ *
+ */
+void editorUnlock(void)
+{
+	pthread_mutex_unlock(&editor.lock);
+}
+
 /**
  *	editorReadKey
  *
  *	@param none
  *
- *	Wait for single byte then return
+ *	Release the editor lock while waiting so the loader can make progress
  *
  */
 int editorReadKey(void)
 {
-	int nread;
-	char ch;
-	char sequence[3];
+	double start = editorClock();
+	int key;
+
+	editorUnlock();
+	key = editorReadKeyUnlocked();
+	editorLock();
+
+	editor.stats.wait += editorClock() - start;
+	editor.stats.keys++;
+
+	return key;
+}
+
+/**
+ *	editorReadKeyUnlocked
+ *
+ *	@param none
+ *
+ *	Return the next key, reading more input when the buffer holds no
+ *	complete key; handles resizes, timers and load progress while idle
+ *
+ */
+int editorReadKeyUnlocked(void)
+{
+	int key, status, timeout;
 
-	while ((nread = read(STDERR_FILENO, &ch, 1)) != 1)
+	while ((status = editorInputDecode(&key, false)) != 1)
 	{
-		if (nread == -1 && errno != EAGAIN)
+		editorLock();
+		timeout = (status == -1) ? INPUT_WAIT_MS : editorEventTimeout();
+		editorUnlock();
+
+		if (editorInputFill(timeout) > 0)
 		{
-			die("read");
+			continue;
+		}
+
+		// nothing followed a partial escape sequence, so it was a lone escape
+		if (status == -1)
+		{
+			editorInputDecode(&key, true);
+			break;
 		}
+
+		editorLock();
+		editorHandleEvents();
+		editorUnlock();
 	}
 
-	// handle 4 directional keypress
-	if (ch == '\x1b')
+	return key;
+}
+
+/**
+ *	editorInputFill
+ *
+ *	@param timeout milliseconds to wait for the first byte
+ *
+ *	Read everything available on standard input into the ring buffer.
+ *	Also returns early when the wake pipe fires. Returns the number of
+ *	bytes read.
+ */
+int editorInputFill(int timeout)
+{
+	struct input *in = &editor.input;
+	struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {editor.wakefd[0], POLLIN, 0}};
+	unsigned int space, at;
+	int total = 0, nread;
+	char drain[64];
+
+	while ((space = INPUT_BUF_SIZE - (in->tail - in->head)) > 0)
 	{
-		if (read(STDIN_FILENO, &sequence[0], 1) != 1)
+		if (poll(pfd, 2, (total != 0) ? 0 : timeout) <= 0)
 		{
-			return '\x1b';
+			break;
 		}
 
-		if (read(STDIN_FILENO, &sequence[1], 1) != 1)
+		if (pfd[1].revents & POLLIN)
 		{
-			return '\x1b';
+			while (read(editor.wakefd[0], drain, sizeof(drain)) > 0)
+			{
+			}
 		}
 
-		if (sequence[0] == '[')
+		if (!(pfd[0].revents & (POLLIN | POLLHUP)))
 		{
-			if (sequence[1] >= '0' && sequence[1] <= '9')
-			{
-				if (read(STDERR_FILENO, &sequence[2], 1) != 1)
-				{
-					return '\x1b';
-				}
+			break;
+		}
 
-				if (sequence[2] == '~')
-				{
-					switch (sequence[1])
-					{
-						case '1':
-							{
-								return HOME_KEY;
-								break;
-							}
-
-						case '3':
-							{
-								return DEL_KEY;
-								break;
-							}
-
-						case '4':
-							{
-								return END_KEY;
-								break;
-							}
-
-						case '5':
-							{
-								return PAGE_UP;
-								break;
-							}
-
-						case '6':
-							{
-								return PAGE_DOWN;
-								break;
-							}
-
-						case '7':
-							{
-								return HOME_KEY;
-								break;
-							}
-
-						case '8':
-							{
-								return END_KEY;
-								break;
-							}
-					}
-				}
-			}
-			else
-			{
-				switch (sequence[1])
-				{
-					case 'A':
-						{
-							return ARROW_UP;
-						}
-
-					case 'B':
-						{
-							return ARROW_DOWN;
-						}
-
-					case 'C':
-						{
-							return ARROW_RIGHT;
-						}
-
-					case 'D':
-						{
-							return ARROW_LEFT;
-						}
-
-					case 'H':
-						{
-							return HOME_KEY;
-						}
-
-					case 'F':
-						{
-							return END_KEY;
-						}
-				}
-			}
+		at = in->tail & (INPUT_BUF_SIZE - 1);
+		if (space > INPUT_BUF_SIZE - at)
+		{
+			space = INPUT_BUF_SIZE - at;
 		}
-		else if (sequence[0] == 'O')
+
+		nread = read(STDIN_FILENO, &in->buf[at], space);
+		if ((nread == -1 && errno != EAGAIN && errno != EINTR) || nread == 0)
 		{
-			switch (sequence[1])
-			{
-				case 'H':
-					{
-						return HOME_KEY;
-					}
+			// readable but empty means the terminal is gone
+			die("read");
+		}
 
-				case 'F':
-					{
-						return END_KEY;
-					}
-			}
+		if (nread <= 0)
+		{
+			break;
 		}
 
-		return '\x1b';
-	}
-	else
-	{
-		return ch;
+		in->tail += nread;
+		total += nread;
 	}
+
+	return total;
 }
 
 /**
- *	editorOpen
+ *	editorInputPending
  *
- *	@param filename path to file
- * 	
- *	handles file i/o
+ *	@param none
+ *
+ *	Whether more input is waiting, buffered or not yet read
  */
-void editorOpen(char *filename)
+bool editorInputPending(void)
 {
-	if (editor.filename != NULL)
-	{
-		free(editor.filename);
-	}
+	return editor.input.tail != editor.input.head || editorInputFill(0) > 0;
+}
 
-	editor.filename = strdup(filename);
-	editorSelectSyntaxHighlight();
-
-	FILE *fp = fopen(filename, "r");
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
+/**
+ *	editorEventInit
+ *
+ *	@param none
+ *
+ *	Set up the wake pipe. Signal handlers and worker threads write a byte
+ *	to it so the event loop's poll returns.
+ */
+void editorEventInit(void)
+{
+	struct sigaction sa;
+	int i;
 
-	if (!fp)
+	if (pipe(editor.wakefd) == -1)
 	{
-		die("fopen");
+		die("pipe");
 	}
 
-	linelen = getline(&line, &linecap, fp);
-	while ((linelen = getline(&line, &linecap, fp)) != -1)
+	for (i = 0; i < 2; i++)
 	{
-		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-		{
-			linelen--;
-		}
-
-		editorInsertRow(editor.numrows, line, linelen);
+		fcntl(editor.wakefd[i], F_SETFL, O_NONBLOCK);
+		fcntl(editor.wakefd[i], F_SETFD, FD_CLOEXEC);
 	}
 
-	free(line);
-	fclose(fp);
-	editor.dirty = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = editorHandleWinch;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGWINCH, &sa, NULL) == -1)
+	{
+		die("sigaction");
+	}
 }
 
 /**
- *	editorSave
+ *	editorWake
  *
- *	@param none
- *	
+ *	@param why byte describing the event, for debugging only
+ *
+ *	Wake the event loop; safe from signal handlers and other threads
  */
-void editorSave(void)
+void editorWake(char why)
 {
-	int len, fd;
-	char *buf;
-
-	if (editor.filename == NULL)
-	{
-		editor.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-		if (editor.filename == NULL)
-		{
-			editorSetStatusMessage("Save aborted");
-			return;
-		}
-
-		editorSelectSyntaxHighlight();
-	}
-
-	buf = editorRowsToString(&len);
-	fd = open(editor.filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1)
+	if (editor.wakefd[1] != -1)
 	{
-		if (ftruncate(fd, len) != -1)
-		{
-			if (write(fd, buf, len) == len)
-			{
-				close(fd);
-				free(buf);
-				editor.dirty = 0;
-				editorSetStatusMessage("%d bytes written to disk", len);
-				return;
-			}
-		}
-
-		close(fd);
+		write(editor.wakefd[1], &why, 1);
 	}
-
-	free(buf);
-	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
-
 }
 
 /**
- *	editorFindCallback
- * 
- * 	@param query search query
- * 	@param key character
+ *	editorHandleWinch
+ *
+ *	@param sig signal number
  *
  */
-void editorFindCallback(char *query, int key)
+void editorHandleWinch(int sig)
 {
-	static int last_match = -1;
-	static int direction = 1;
-	static int saved_hl_line;
-	static char *saved_hl = NULL;
+	(void) sig;
 
-	int i, current;
-	char *match;
-	erow * row;
+	editor.resized = 1;
+	editorWake('w');
+}
 
-	if (saved_hl)
-	{
-		memcpy(editor.row[saved_hl_line].hl, saved_hl, editor.row[saved_hl_line].rsize);
-		free(saved_hl);
-		saved_hl = NULL;
-	}
+/**
+ *	editorEventTimeout
+ *
+ *	@param none
+ *
+ *	Milliseconds until the next timer is due, -1 when none is pending. The
+ *	timers are the status message expiring and unfinished highlighting.
+ */
+int editorEventTimeout(void)
+{
+	struct timespec ts;
+	long ms;
 
-	if (key == '\r' || key == '\x1b')
-	{
-		last_match = -1;
-		direction = 1;
-		return;
-	}
-	else if (key == ARROW_DOWN || ARROW_RIGHT)
-	{
-		direction = 1;
-	}
-	else if (key == ARROW_UP || ARROW_LEFT)
+	// highlighting fell behind the viewport, keep drawing until it catches up
+	if (editor.hl_behind && !editor.hlw.running)
 	{
-		direction = -1;
-	}
-	else
-	{
-		last_match = -1;
-		direction = 1;
+		return 0;
 	}
-
-	if (last_match == -1)
+	else if (!editor.statusmsg_shown)
 	{
-		direction = 1;
+		return -1;
 	}
 
-	current = last_match;
-	for (i = 0; i < editor.numrows; i++)
-	{
-		current += direction;
-		if (current == -1)
-		{
-			current = editor.numrows - 1;
-		}
-		else if (current == editor.numrows)
-		{
-			current = 0;
-		}
-
-		row = &editor.row[current];
-		match = strstr(row->render, query);
+	// a little slack so time() has ticked over by the time we wake
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ms = (editor.statusmsg_timestamp + STATUS_MSG_SECONDS) * 1000L - \
+		(ts.tv_sec * 1000L + ts.tv_nsec / 1000000) + 10;
 
-		if (match)
-		{
-			last_match = current;
-			editor.cy = current;
-			editor.cx = editorRowRxToCx(row, match - row->render);
-			editor.rowoff = editor.numrows;
-
-			saved_hl_line = current;
-			saved_hl = malloc(row->rsize);
-			memcpy(saved_hl, row->hl, row->rsize);
-			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-			break;
-		}
-	}
+	return (ms > 0) ? ms : 0;
 }
 
 /**
- *	editorFind
- * 
- * 	@param none
+ *	editorHandleEvents
  *
+ *	@param none
+ *
+ *	Redraw for whatever woke the loop without a key: a resize, an expired
+ *	status message, load progress, or highlight and search results to
+ *	pick up
  */
-void editorFind(void)
+void editorHandleEvents(void)
 {
-	char *query = NULL;
-	int saved_cx = editor.cx;
-	int saved_cy = editor.cy;
-	int saved_rowoff = editor.rowoff;
-	int saved_coloff = editor.coloff;
+	bool redraw = editor.load_shown || editor.statusmsg_shown || editor.hl_behind || \
+		editor.hl_viewport_queued || editor.hl_background_queued;
 
-	query = editorPrompt("Search: %s (ESC/Arrows/Enter)", editorFindCallback);
+	if (editor.resized)
+	{
+		editor.resized = 0;
+		editorUpdateWindowSize();
+		redraw = true;
+	}
 
-	if (query != NULL)
+	// search results that came in, or rows the loader added to search
+	if (editor.search.valid && editorSearchCollect())
 	{
-		free(query);
+		editorSearchPrompt();
+		editorSetStatusMessage(editor.search.prompt, editor.search.query);
+		editorSearchShow();
+		redraw = true;
 	}
-	else
+
+	if (redraw)
 	{
-		editor.cx = saved_cx;
-		editor.cy = saved_cy;
-		editor.rowoff = saved_rowoff;
-		editor.coloff = saved_coloff;
+		editorRefreshScreen();
 	}
 }
 
 /**
- *	editorMoveCursor
+ *	editorInputPaste
  *
- *	@param key keypad character
+ *	@param lenp set to the length of the pasted text
  *
- *	handles wasd key press
+ *	Take the raw bytes of a bracketed paste up to its end marker, with the
+ *	terminal's carriage returns turned back into newlines. If the marker
+ *	never comes, the paste ends once input has been idle for a while.
  */
-char *editorPrompt(char *prompt, void(*callback)(char *, int))
+char *editorInputPaste(int *lenp)
 {
-	size_t bufsize = 128, buflen = 0;
-	char *buf = malloc(bufsize);
-	int ch;
+	struct input *in = &editor.input;
+	struct abuf ab = ABUF_INIT;
+	double last = editorClock();
+	unsigned int at, n;
+	bool done = false;
+	char *end;
+	int from, i, len = 0;
 
-	buf[0] = '\0';
-	while (1)
+	while (!done)
 	{
-		editorSetStatusMessage(prompt, buf);
-		editorRefreshScreen();
-
-		ch = editorReadKey();
-		if (ch == DEL_KEY || ch == CTRL_KEY('h') || ch == BACKSPACE)
+		while (in->head != in->tail && !done)
 		{
-			if (buflen != 0)
+			at = in->head & (INPUT_BUF_SIZE - 1);
+			n = in->tail - in->head;
+			if (n > INPUT_BUF_SIZE - at)
 			{
-				buf[--buflen] = '\0';
+				n = INPUT_BUF_SIZE - at;
 			}
-		}
-		else if (ch == '\x1b')
-		{
-			editorSetStatusMessage("");
-			if (callback)
+
+			// the marker may straddle two reads
+			from = (ab.len >= 5) ? ab.len - 5 : 0;
+			abAppend(&ab, &in->buf[at], n);
+			in->head += n;
+
+			end = memmem(&ab.b[from], ab.len - from, PASTE_END_SEQ, 6);
+			if (end != NULL)
 			{
-				callback(buf, ch);
+				// hand back whatever was typed after the paste
+				in->head -= ab.len - (end - ab.b + 6);
+				ab.len = end - ab.b;
+				done = true;
 			}
-
-			free(buf);
-			return NULL;
 		}
-		else if (ch == '\r')
+
+		if (done)
 		{
-			if (buflen != 0)
-			{
-				editorSetStatusMessage("");
-				if (callback)
-				{
-					callback(buf, ch);
-				}
+			break;
+		}
 
-				return buf;
-			}
+		// a truncated paste or a typed start marker would otherwise wait forever
+		if (editorInputFill(INPUT_WAIT_MS) > 0)
+		{
+			last = editorClock();
 		}
-		else if (!iscntrl(ch) && ch < 128)
+		else if (editorClock() - last >= PASTE_IDLE_SECONDS)
 		{
-			if (buflen == bufsize - 1)
-			{
-				bufsize *= 2;
-				buf = realloc(buf, bufsize);
-			}
-
-			buf[buflen++] = ch;
-			buf[buflen] = '\0';
+			done = true;
 		}
+	}
 
-		if (callback)
+	for (i = 0; i < ab.len; i++)
+	{
+		if (ab.b[i] != '\r')
 		{
-			callback(buf, ch);
+			ab.b[len++] = ab.b[i];
+		}
+		else if (i + 1 == ab.len || ab.b[i + 1] != '\n')
+		{
+			ab.b[len++] = '\n';
 		}
 	}
+
+	*lenp = len;
+	return ab.b;
 }
 
 /**
- *	editorMoveCursor
+ *	editorInputDecode
  *
- *	@param key keypad character
+ *	@param key set to the decoded key
+ *	@param flush take an incomplete escape sequence as a lone escape
  *
- *	handles wasd key press
+ *	Decode one key from the ring buffer. Returns 1 when a key was decoded,
+ *	0 when the buffer is empty and -1 when it ends inside an escape
+ *	sequence that may still be completed by the next read.
  */
-void editorMoveCursor(int key)
+int editorInputDecode(int *key, bool flush)
 {
-	erow * row;
-	int rowlen;
+	struct input *in = &editor.input;
+	unsigned int avail = in->tail - in->head, len, param = 0;
+	char ch, sequence[INPUT_SEQ_MAX];
 
-	if (editor.cy >= editor.numrows)
+	if (avail == 0)
 	{
-		row = NULL;
+		return 0;
 	}
-	else
+
+	for (len = 0; len < avail && len < INPUT_SEQ_MAX; len++)
 	{
-		row = &editor.row[editor.cy];
+		sequence[len] = in->buf[(in->head + len) & (INPUT_BUF_SIZE - 1)];
 	}
 
-	switch (key)
+	if (sequence[0] != '\x1b')
 	{
-		case ARROW_LEFT:
-			{
-				if (editor.cx != 0)
+		in->head++;
+		*key = (unsigned char) sequence[0];
+
+		return 1;
+	}
+
+	*key = '\x1b';
+
+	// find the end of the sequence: ESC O x, ESC [ x or ESC [ digits x
+	len = 2;
+	if (avail >= 2 && sequence[1] == '[')
+	{
+		while (len < avail && len < INPUT_SEQ_MAX - 1 && isdigit((unsigned char) sequence[len]))
+		{
+			param = param * 10 + (sequence[len] - '0');
+			len++;
+		}
+
+		len++;
+	}
+
+	if (avail < len)
+	{
+		if (!flush)
+		{
+			return -1;
+		}
+
+		in->head += avail;
+
+		return 1;
+	}
+
+	in->head += len;
+	ch = sequence[len - 1];
+
+	if (sequence[1] == '[' && len > 3 && ch == '~')
+	{
+		switch (param)
+		{
+			case 1:
+			case 7:
 				{
-					editor.cx--;
+					*key = HOME_KEY;
+					break;
 				}
-				else if (editor.cy > 0)
+
+			case 3:
 				{
-					editor.cy--;
-					editor.cx = editor.row[editor.cy].size;
+					*key = DEL_KEY;
+					break;
 				}
 
-				break;
-			}
+			case 4:
+			case 8:
+				{
+					*key = END_KEY;
+					break;
+				}
 
-		case ARROW_RIGHT:
-			{
-				if (row != NULL && editor.cx < row->size)
+			case 5:
 				{
-					editor.cx++;
+					*key = PAGE_UP;
+					break;
 				}
-				else if (row != NULL && editor.cx == row->size)
+
+			case 6:
 				{
-					editor.cy++;
-					editor.cx = 0;
+					*key = PAGE_DOWN;
+					break;
 				}
 
-				break;
-			}
+			case 200:
+				{
+					*key = PASTE_START;
+					break;
+				}
 
-		case ARROW_DOWN:
-			{
-				if (editor.cy < editor.numrows)
+			case 201:
 				{
-					editor.cy++;
+					*key = PASTE_END;
+					break;
+				}
+		}
+	}
+	else if (sequence[1] == '[' && len == 3)
+	{
+		switch (ch)
+		{
+			case 'A':
+				{
+					*key = ARROW_UP;
+					break;
 				}
 
-				break;
-			}
+			case 'B':
+				{
+					*key = ARROW_DOWN;
+					break;
+				}
 
-		case ARROW_UP:
-			{
-				if (editor.cy != 0)
+			case 'C':
 				{
-					editor.cy--;
+					*key = ARROW_RIGHT;
+					break;
 				}
 
-				break;
-			}
-	}
+			case 'D':
+				{
+					*key = ARROW_LEFT;
+					break;
+				}
 
-	if (editor.cy >= editor.numrows)
-	{
-		row = NULL;
+			case 'H':
+				{
+					*key = HOME_KEY;
+					break;
+				}
+
+			case 'F':
+				{
+					*key = END_KEY;
+					break;
+				}
+		}
 	}
-	else
+	else if (sequence[1] == 'O')
 	{
-		row = &editor.row[editor.cy];
+		switch (ch)
+		{
+			case 'H':
+				{
+					*key = HOME_KEY;
+					break;
+				}
+
+			case 'F':
+				{
+					*key = END_KEY;
+					break;
+				}
+		}
 	}
 
-	if (row != NULL)
+	return 1;
+}
+
+/**
+ *	editorReadFile
+ *
+ *	@param fd open file descriptor
+ *	@param lenp set to number of bytes read
+ *
+ *	Read the whole file into one buffer, sized up front for regular files
+ */
+char *editorReadFile(int fd, size_t *lenp)
+{
+	struct stat st;
+	size_t cap = 64 * 1024, len = 0;
+	ssize_t nread;
+	char *buf, *new;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
 	{
-		rowlen = row->size;
+		cap = st.st_size + 1;
 	}
-	else
+
+	buf = malloc(cap);
+	if (buf == NULL)
 	{
-		rowlen = 0;
+		return NULL;
 	}
 
-	if (editor.cx > rowlen)
+	while (true)
 	{
-		editor.cx = rowlen;
+		if (len == cap)
+		{
+			cap *= 2;
+			new = realloc(buf, cap);
+			if (new == NULL)
+			{
+				free(buf);
+				return NULL;
+			}
+
+			buf = new;
+		}
+
+		nread = read(fd, &buf[len], cap - len);
+		if (nread == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (nread == -1)
+		{
+			free(buf);
+			return NULL;
+		}
+		else if (nread == 0)
+		{
+			break;
+		}
+
+		len += nread;
 	}
+
+	*lenp = len;
+	return buf;
 }
 
 /**
- *	editorProcessKeypress
+ *	editorOpen
  *
- *	@param none
- * 
- *	handles key press from editorReadKey()
+ *	@param filename path to file
+ * 	
+ *	handles file i/o; regular files are mapped rather than read and only
+ *	the rows needed for the first screen are indexed up front
  */
-void editorProcessKeypress(void)
+void editorOpen(char *filename)
 {
-	static int quit_times = QUIT_TIMES;
-	int ch = editorReadKey();
-	int times;
+	int fd;
+	struct stat st;
+	void *map;
 
-	switch (ch)
+	if (editor.filename != NULL)
 	{
-		case '\r':
-			{
-				editorInsertNewLine();
-				break;
-			}
+		free(editor.filename);
+	}
 
-		case CTRL_KEY('q'):
-			{
-				if (editor.dirty && quit_times > 0)
-				{
-					editorSetStatusMessage("WARNING!!! File has unsaved changes. "\
-						"Press Ctrl-Q %d more times to quit.", quit_times);
-					quit_times--;
-					return;
-				}
+	editor.filename = strdup(filename);
+	editorSelectSyntaxHighlight();
 
-				write(STDOUT_FILENO, "\x1b[2J", 4);
-				write(STDOUT_FILENO, "\x1b[H", 3);
-				exit(0);
-				break;
-			}
+	fd = open(filename, O_RDONLY);
+	if (fd == -1)
+	{
+		die("open");
+	}
 
-		case CTRL_KEY('s'):
-			{
-				editorSave();
-				break;
-			}
+	editor.text.mapped = false;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			editor.text.orig = map;
+			editor.text.origlen = st.st_size;
+			editor.text.mapped = true;
+		}
+	}
 
-		case HOME_KEY:
-			{
-				editor.cx = 0;
-				break;
-			}
+	if (!editor.text.mapped)
+	{
+		editor.text.orig = editorReadFile(fd, &editor.text.origlen);
+		if (editor.text.orig == NULL)
+		{
+			die("read");
+		}
+	}
 
-		case END_KEY:
-			{
-				if (editor.cy < editor.numrows)
-				{
-					editor.cx = editor.row[editor.cy].size;
-				}
+	close(fd);
 
-				break;
-			}
+	editor.text.indexed = 0;
+	editorIndexRows(editor.screenrows + 1);
+	editor.dirty = 0;
 
-		case CTRL_KEY('f'):
-			{
-				editorFind();
-				break;
-			}
+	editorLoadStart();
+}
 
-		case BACKSPACE:
-		case CTRL_KEY('h'):
-		case DEL_KEY:
-			{
-				if (ch == DEL_KEY)
-				{
-					editorMoveCursor(ARROW_RIGHT);
-				}
+/**
+ *	editorLoadThread
+ *
+ *	@param arg unused
+ *
+ *	Index the rest of the file in chunks. Pages are faulted in outside the
+ *	editor lock so the disk reads never stall the UI.
+ */
+void *editorLoadThread(void *arg)
+{
+	const char *orig = editor.text.orig;
+	size_t origlen = editor.text.origlen;
+	size_t off, end, i;
+	volatile char sink = 0;
+	double woke = editorClock();
 
-				editorDelChar();
-				break;
-			}
+	(void) arg;
 
-		case PAGE_UP:
-		case PAGE_DOWN:
-			{
-				if (ch == PAGE_UP)
-				{
-					editor.cy = editor.rowoff;
-				}
-				else if (ch == PAGE_DOWN)
-				{
-					editor.cy = editor.rowoff + editor.screenrows - 1;
-					if (editor.cy > editor.numrows)
-					{
-						editor.cy = editor.numrows;
-					}
-				}
+	while (true)
+	{
+		editorLock();
+		off = editor.text.indexed;
+		editorUnlock();
 
-				times = editor.screenrows;
-				while (times-- != 0)
-				{
-					editorMoveCursor(ch == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-				}
+		if (off >= origlen)
+		{
+			break;
+		}
 
-				break;
-			}
+		end = (origlen - off > LOAD_PREFETCH_BYTES) ? off + LOAD_PREFETCH_BYTES : origlen;
+		for (i = off; i < end; i += 4096)
+		{
+			sink += orig[i];
+		}
 
-		case ARROW_UP:
-		case ARROW_DOWN:
-		case ARROW_LEFT:
-		case ARROW_RIGHT:
-			{
-				editorMoveCursor(ch);
-				break;
-			}
+		editorLock();
+		// search workers read the rows without the lock, wait until they finish
+		while (editor.rows_pinned)
+		{
+			pthread_cond_wait(&editor.rows_unpinned, &editor.lock);
+		}
 
-		case CTRL_KEY('l'):
-		case '\x1b':
-			{
-				break;
-			}
+		editorIndexRows(editor.numrows + LOAD_CHUNK_ROWS);
+		editorUnlock();
 
-		default:
-			{
-				editorInsertChar(ch);
-				break;
-			}
+		// let the main loop redraw the progress now and then
+		if (editorClock() - woke >= LOAD_WAKE_INTERVAL)
+		{
+			woke = editorClock();
+			editorWake('l');
+		}
 	}
 
-	quit_times = QUIT_TIMES;
+	editorLock();
+	editor.loading = false;
+	editorUnlock();
+	editorWake('l');
+
+	return NULL;
 }
 
 /**
- *	editorDrawRows
+ *	editorLoadStart
  *
- *	@param ab buffer
+ *	@param none
  *
+ *	Hand the remainder of the file to a loader thread, or index it here if
+ *	no thread can be started
  */
-void editorDrawRows(struct abuf *ab)
+void editorLoadStart(void)
 {
-	int y, len, j, clen, color, current_color = -1;
-	char *ch;
-	unsigned char *hl;
-	int filerow;
-	char buf[16], symbol;
+	pthread_t thread;
 
-	for (y = 0; y < editor.screenrows; y++)
+	if (editor.text.indexed >= editor.text.origlen)
 	{
-		filerow = y + editor.rowoff;
-		if (filerow >= editor.numrows)
-		{
-			if (editor.numrows == 0 && y == editor.screenrows / 3)
-			{
-				char welcome[80];
-				int welcomelen = snprintf(welcome, sizeof(welcome),
-					"Kilo editor -- version %s", KILO_VERSION);
-				if (welcomelen > editor.screencols) welcomelen = editor.screencols;
-				int padding = (editor.screencols - welcomelen) / 2;
-				if (padding)
-				{
-					abAppend(ab, "~", 1);
-					padding--;
-				}
+		return;
+	}
 
-				while (padding--) abAppend(ab, " ", 1);
-				abAppend(ab, welcome, welcomelen);
-			}
-			else
-			{
-				abAppend(ab, "~", 1);
-			}
-		}
-		else
-		{
-			len = editor.row[filerow].rsize - editor.coloff;
-			if (len < 0)
-			{
-				len = 0;
-			}
+	if (editor.text.mapped)
+	{
+		madvise(editor.text.orig, editor.text.origlen, MADV_SEQUENTIAL);
+	}
 
-			if (len > editor.screencols)
-			{
-				len = editor.screencols;
-			}
+	editor.loading = true;
+	if (pthread_create(&thread, NULL, editorLoadThread, NULL) != 0)
+	{
+		editor.loading = false;
+		editorIndexRows(INT_MAX);
+		return;
+	}
 
-			ch = &editor.row[filerow].render[editor.coloff];
-			hl = &editor.row[filerow].hl[editor.coloff];
-			current_color = -1;
-			for (j = 0; j < len; j++)
-			{
-				if (iscntrl(ch[j]))
-				{
-					if (ch[j] <= 26)
-					{
-						symbol = '@' + ch[j];
-					}
-					else
-					{
-						symbol = '?';
-					}
+	pthread_detach(thread);
+}
 
-					abAppend(ab, "\x1b[7m", 4);
-					abAppend(ab, &symbol, 1);
-					abAppend(ab, "\x1b[m", 3);
+/**
+ *	editorIndexRows
+ *
+ *	@param upto number of rows wanted, INT_MAX for the whole file
+ *
+ *	Extend the line index over the original buffer until it holds upto
+ *	rows. Rows are created without render or highlight data. Nothing is
+ *	added while search workers are reading the rows.
+ */
+void editorIndexRows(int upto)
+{
+	const char *line, *end, *nl;
+	size_t linelen;
+	erow *row;
 
-					if (current_color != -1)
-					{
-						clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-						abAppend(ab, buf, clen);
-					}
-				}
-				else if (hl[j] == HL_NORMAL)
+	if (editor.text.orig == NULL || editor.rows_pinned)
+	{
+		return;
+	}
+
+	end = editor.text.orig + editor.text.origlen;
+	line = editor.text.orig + editor.text.indexed;
+	while (editor.numrows < upto && line < end)
+	{
+		nl = memchr(line, '\n', end - line);
+		if (nl == NULL)
+		{
+			nl = end;
+		}
+
+		linelen = nl - line;
+		while (linelen > 0 && line[linelen - 1] == '\r')
+		{
+			linelen--;
+		}
+
+		row = editorRowTreeInsert(editor.numrows);
+		editorRowInit(row, line, linelen);
+		editor.numrows++;
+
+		line = (nl < end) ? nl + 1 : end;
+	}
+
+	editor.text.indexed = line - editor.text.orig;
+}
+
+/**
+ *	editorTextRebase
+ *
+ *	@param buf full text of the buffer, one '\n' after each row
+ *
+ *	Make buf the new original buffer after a save so rows no longer point
+ *	into a file that has just been rewritten, dropping the old pieces
+ */
+void editorTextRebase(char *buf, size_t len)
+{
+	erow *row;
+	char *p = buf;
+
+	for (row = editorRowAt(0); row != NULL; row = editorRowNext(row))
+	{
+		free(row->pieces);
+		row->pieces = NULL;
+		row->piececap = 0;
+		row->npieces = (row->size > 0) ? 1 : 0;
+		row->piece.data = p;
+		row->piece.len = row->size;
+		p += row->size + 1;
+	}
+
+	if (editor.text.mapped)
+	{
+		munmap(editor.text.orig, editor.text.origlen);
+	}
+	else
+	{
+		free(editor.text.orig);
+	}
+
+	editor.text.orig = buf;
+	editor.text.origlen = len;
+	editor.text.indexed = len;
+	editor.text.mapped = false;
+}
+
+/**
+ *	editorWriteAll
+ *
+ *	@param fd file descriptor
+ *	@param buf data to write
+ *	@param len length of data
+ *
+ *	write() until all of buf is out, retrying short writes and EINTR
+ */
+bool editorWriteAll(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0)
+	{
+		n = write(fd, buf, len);
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (n <= 0)
+		{
+			return false;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/**
+ *	editorSaveTemp
+ *
+ *	@param path file to replace, with symlinks resolved
+ *	@param st status of the file, NULL if it doesn't exist yet
+ *	@param buf new contents
+ *	@param len length of buf
+ *
+ *	Write buf to a new file next to path with path's owner and mode, then
+ *	rename it over path, so path is never left half written. Returns
+ *	false with errno set if path is unchanged.
+ */
+bool editorSaveTemp(const char *path, const struct stat *st, const char *buf, size_t len)
+{
+	char *tmp = malloc(strlen(path) + 8);
+	mode_t mask;
+	bool ok;
+	int fd, err;
+
+	if (tmp == NULL)
+	{
+		die("malloc");
+	}
+
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+	{
+		err = errno;
+		free(tmp);
+		errno = err;
+		return false;
+	}
+
+	if (st != NULL)
+	{
+		ok = fchown(fd, st->st_uid, st->st_gid) == 0 && fchmod(fd, st->st_mode & 07777) == 0;
+	}
+	else
+	{
+		mask = umask(0);
+		umask(mask);
+		ok = fchmod(fd, 0644 & ~mask) == 0;
+	}
+
+	ok = ok && editorWriteAll(fd, buf, len) && fsync(fd) == 0;
+	err = errno;
+	if (close(fd) == -1 && ok)
+	{
+		ok = false;
+		err = errno;
+	}
+
+	if (ok && rename(tmp, path) == -1)
+	{
+		ok = false;
+		err = errno;
+	}
+
+	if (!ok)
+	{
+		unlink(tmp);
+	}
+
+	free(tmp);
+	errno = err;
+
+	return ok;
+}
+
+/**
+ *	editorSaveInPlace
+ *
+ *	@param path file to overwrite
+ *	@param buf new contents
+ *	@param len length of buf
+ *
+ *	Write buf over the file itself, which keeps its links and owner. Rows
+ *	must not point into the file. Returns false with errno set on failure.
+ */
+bool editorSaveInPlace(const char *path, const char *buf, size_t len)
+{
+	int fd = open(path, O_WRONLY | O_TRUNC), err;
+	bool ok;
+
+	if (fd == -1)
+	{
+		return false;
+	}
+
+	ok = editorWriteAll(fd, buf, len) && fsync(fd) == 0;
+	err = errno;
+	if (close(fd) == -1 && ok)
+	{
+		ok = false;
+		err = errno;
+	}
+
+	errno = err;
+
+	return ok;
+}
+
+/**
+ *	editorSave
+ *
+ *	@param none
+ *	
+ */
+void editorSave(void)
+{
+	bool exists, inplace, ok;
+	char *buf, *path;
+	const char *target;
+	struct stat st;
+	size_t len;
+	int err;
+
+	if (editor.filename == NULL)
+	{
+		editor.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+		if (editor.filename == NULL)
+		{
+			editorSetStatusMessage("Save aborted");
+			return;
+		}
+
+		editorSelectSyntaxHighlight();
+	}
+
+	if (editor.loading)
+	{
+		editorSetStatusMessage("Can't save while the file is still loading");
+		return;
+	}
+
+	// save to what a symlink points at rather than replacing the link
+	path = realpath(editor.filename, NULL);
+	target = (path != NULL) ? path : editor.filename;
+	exists = (stat(target, &st) == 0);
+	inplace = exists && st.st_nlink > 1;
+
+	editorUndoRebase();
+	buf = editorRowsToString(&len);
+	ok = !inplace && editorSaveTemp(target, exists ? &st : NULL, buf, len);
+	if (!ok && exists && (inplace || errno == EPERM))
+	{
+		// other hard links, or an owner a new file can't be given: the file
+		// is overwritten itself, once the rows no longer point into it
+		editorTextRebase(buf, len);
+		buf = NULL;
+		inplace = true;
+		ok = editorSaveInPlace(target, editor.text.orig, len);
+	}
+
+	err = errno;
+	free(path);
+	if (ok)
+	{
+		if (!inplace)
+		{
+			editorTextRebase(buf, len);
+		}
+
+		editorUndoSaved();
+		editor.dirty = 0;
+		editorSetStatusMessage("%zu bytes written to disk", len);
+		return;
+	}
+
+	free(buf);
+	editorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+}
+
+/**
+ *	editorFindCallback
+ * 
+ * 	@param query search query
+ * 	@param key character
+ *
+ */
+void editorFindCallback(char *query, int key)
+{
+	struct search *s = &editor.search;
+
+	free(s->query);
+	s->query = strdup(query);
+	if (s->query == NULL)
+	{
+		die("strdup");
+	}
+
+	if (key == '\r' || key == '\x1b')
+	{
+		editorSearchCancel();
+		editorRegexFree(&s->re);
+		s->valid = false;
+		s->current = -1;
+		editorSearchShow();
+		return;
+	}
+	else if ((key == ARROW_DOWN || key == ARROW_RIGHT) && s->set.n > 0)
+	{
+		s->current = (s->current + 1) % s->set.n;
+	}
+	else if ((key == ARROW_UP || key == ARROW_LEFT) && s->set.n > 0)
+	{
+		s->current = (s->current + s->set.n - 1) % s->set.n;
+	}
+	else if (key == CTRL_KEY('t') || key == CTRL_KEY('r'))
+	{
+		editorSearchCancel();
+		s->nocase = (key == CTRL_KEY('t')) ? !s->nocase : s->nocase;
+		s->regex = (key == CTRL_KEY('r')) ? !s->regex : s->regex;
+		s->valid = false;
+		editorSearchUpdate(query);
+	}
+	else if (key != ARROW_DOWN && key != ARROW_RIGHT && key != ARROW_UP && key != ARROW_LEFT)
+	{
+		editorSearchUpdate(query);
+	}
+
+	if (s->valid)
+	{
+		editorSearchCollect();
+	}
+
+	editorSearchPrompt();
+	editorSearchShow();
+}
+
+/**
+ *	editorSearchShow
+ *
+ *	@param none
+ *
+ *	Move to the current match. The matches themselves are drawn over the
+ *	rows by editorDrawMatches, so nothing is written into the rows here.
+ */
+void editorSearchShow(void)
+{
+	struct search *s = &editor.search;
+	struct match *m;
+
+	if (!s->valid || s->current == -1)
+	{
+		return;
+	}
+
+	m = &s->set.m[s->current];
+	editor.cy = m->row;
+	editor.cx = m->cx;
+	editor.rowoff = editor.numrows;
+}
+
+/**
+ *	editorSearchUpdate
+ *
+ *	@param query search query as typed so far
+ *
+ *	Bring the match set up to date with the query. A query that extends
+ *	the last one can only match where the last one did, so the rows
+ *	already searched are filtered in place and only the rest is searched
+ *	again; anything else, like a deleted character or any change to a
+ *	pattern, starts over. The current match stays put if it still
+ *	matches, otherwise it moves to the next one.
+ */
+void editorSearchUpdate(const char *query)
+{
+	struct search *s = &editor.search;
+	bool narrow;
+
+	narrow = !s->regex && s->valid && !s->partial && s->len > 0 && (int) strlen(query) >= s->len && \
+		(s->nocase ? strncasecmp(query, s->needle, s->len) : strncmp(query, s->needle, s->len)) == 0;
+	if ((narrow && (int) strlen(query) == s->len) || \
+		(s->regex && s->valid && s->re.source != NULL && strcmp(query, s->re.source) == 0))
+	{
+		return;
+	}
+
+	// the job reads the needle, so it has to stop before the needle changes
+	editorSearchCancel();
+	if (s->current != -1)
+	{
+		s->from = s->set.m[s->current];
+	}
+
+	editorSearchCompile(query);
+	s->current = -1;
+	if (query[0] == '\0' || s->re.error != NULL)
+	{
+		s->valid = false;
+		s->set.n = 0;
+		return;
+	}
+
+	if (narrow)
+	{
+		editorSearchNarrow();
+	}
+	else
+	{
+		s->set.n = 0;
+		s->scanned = 0;
+		s->partial = false;
+	}
+
+	s->valid = true;
+}
+
+/**
+ *	editorSearchCompile
+ *
+ *	@param query text or pattern to look for
+ *
+ *	Set the search needle, lower cased when case is ignored. For a
+ *	pattern the needle is the literal every match contains, if any,
+ *	which narrows the rows the pattern has to run on.
+ */
+void editorSearchCompile(const char *query)
+{
+	struct search *s = &editor.search;
+	int i;
+
+	free(s->needle);
+	editorRegexFree(&s->re);
+	if (s->regex)
+	{
+		editorRegexCompile(&s->re, query, s->nocase);
+		s->needle = editorRegexLiteral(&s->re);
+	}
+	else
+	{
+		s->needle = strdup(query);
+	}
+
+	if (s->needle == NULL)
+	{
+		die("strdup");
+	}
+
+	s->len = strlen(s->needle);
+	for (i = 0; s->nocase && i < s->len; i++)
+	{
+		s->needle[i] = tolower((unsigned char) s->needle[i]);
+	}
+}
+
+/**
+ *	editorSearchPrompt
+ *
+ *	@param none
+ *
+ *	Describe the search options and where the current match falls in the
+ *	prompt editorFind shows
+ */
+void editorSearchPrompt(void)
+{
+	struct search *s = &editor.search;
+	char count[48] = "";
+
+	if (s->regex && s->re.error != NULL)
+	{
+		snprintf(count, sizeof(count), " - %s", s->re.error);
+	}
+	else if (s->valid && s->pool.chunks != NULL && s->current == -1)
+	{
+		snprintf(count, sizeof(count), " - searching, %d so far", s->set.n);
+	}
+	else if (s->valid && s->pool.chunks != NULL)
+	{
+		snprintf(count, sizeof(count), " - %d of %d...", s->current + 1, s->set.n);
+	}
+	else if (s->valid && s->set.n == 0)
+	{
+		snprintf(count, sizeof(count), " - no matches");
+	}
+	else if (s->valid)
+	{
+		snprintf(count, sizeof(count), " - %d of %d%s", s->current + 1, s->set.n, s->partial ? "+" : "");
+	}
+
+	snprintf(s->prompt, sizeof(s->prompt), "%s%s: %%s%s (ESC/Arrows/Enter, Ctrl-T case, Ctrl-R regex)", \
+		s->replacing ? "Replace" : "Search", \
+		s->regex ? (s->nocase ? " (regex, any case)" : " (regex)") : (s->nocase ? " (any case)" : ""), count);
+}
+
+/**
+ *	editorSearchEqual
+ *
+ *	@param p text at least as long as the needle
+ *
+ */
+bool editorSearchEqual(const char *p)
+{
+	const struct search *s = &editor.search;
+
+	return s->nocase ? strncasecmp(p, s->needle, s->len) == 0 : memcmp(p, s->needle, s->len) == 0;
+}
+
+/**
+ *	editorSearchMem
+ *
+ *	@param hay text to search
+ *	@param len length of hay
+ *
+ *	First occurrence of the needle in hay, or NULL. Candidates are the
+ *	offsets where both the first and the last byte of the needle line up,
+ *	found 16 at a time with SSE2, and only those are compared in full.
+ *	Ignoring case costs one OR per byte: with bit 0x20 set on both sides a
+ *	letter matches either case and nothing else.
+ */
+const char *editorSearchMem(const char *hay, size_t len)
+{
+	const struct search *s = &editor.search;
+	size_t i = 0, n = s->len;
+	unsigned char first, last, fm, lm;
+
+	if (n == 0 || len < n)
+	{
+		return NULL;
+	}
+
+	first = s->needle[0];
+	last = s->needle[n - 1];
+	fm = (s->nocase && isalpha(first)) ? 0x20 : 0;
+	lm = (s->nocase && isalpha(last)) ? 0x20 : 0;
+#ifdef __SSE2__
+	__m128i vf = _mm_set1_epi8(first), vl = _mm_set1_epi8(last);
+	__m128i vfm = _mm_set1_epi8(fm), vlm = _mm_set1_epi8(lm), a, b;
+	int mask, j;
+
+	for (; i + n - 1 + 16 <= len; i += 16)
+	{
+		a = _mm_or_si128(_mm_loadu_si128((const __m128i *) &hay[i]), vfm);
+		b = _mm_or_si128(_mm_loadu_si128((const __m128i *) &hay[i + n - 1]), vlm);
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, vf), _mm_cmpeq_epi8(b, vl)));
+		while (mask != 0)
+		{
+			j = __builtin_ctz(mask);
+			if (editorSearchEqual(&hay[i + j]))
+			{
+				return &hay[i + j];
+			}
+
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	for (; i + n <= len; i++)
+	{
+		if (((unsigned char) hay[i] | fm) == first && ((unsigned char) hay[i + n - 1] | lm) == last && \
+			editorSearchEqual(&hay[i]))
+		{
+			return &hay[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ *	editorSearchAdd
+ *
+ *	@param set match set
+ *	@param row row index
+ *	@param cx column of the match
+ *	@param len length of the match
+ *	@param room bytes from the match to the end of the row
+ *	@param text the match in a piece, NULL if it spans pieces
+ *
+ *	Append a match to the set. Past SEARCH_MATCH_MAX the set is only a
+ *	prefix of the matches and false is returned to stop the scan.
+ */
+bool editorSearchAdd(struct matchset *set, int row, int cx, int len, int room, const char *text)
+{
+	struct match *new;
+
+	if (set->n == SEARCH_MATCH_MAX)
+	{
+		return false;
+	}
+
+	if (set->n == set->cap)
+	{
+		set->cap = (set->cap != 0) ? set->cap * 2 : 256;
+		new = realloc(set->m, sizeof(struct match) * set->cap);
+		if (new == NULL)
+		{
+			die("realloc");
+		}
+
+		set->m = new;
+	}
+
+	set->m[set->n].row = row;
+	set->m[set->n].cx = cx;
+	set->m[set->n].len = len;
+	set->m[set->n].room = room;
+	set->m[set->n].text = text;
+	set->n++;
+
+	return true;
+}
+
+/**
+ *	editorSearchRowText
+ *
+ *	@param row editor row
+ *	@param text scratch buffer for rows made of several pieces
+ *
+ *	The row's text in one piece
+ */
+const char *editorSearchRowText(erow *row, struct abuf *text)
+{
+	struct piece *p = editorRowPieces(row);
+	int k;
+
+	if (row->npieces <= 1)
+	{
+		return p[0].data;
+	}
+
+	abReset(text);
+	for (k = 0; k < row->npieces; k++)
+	{
+		abAppend(text, p[k].data, p[k].len);
+	}
+
+	return text->b;
+}
+
+/**
+ *	editorSearchRow
+ *
+ *	@param row editor row
+ *	@param at index of the row
+ *	@param set match set
+ *	@param rs matcher for a pattern, NULL for plain text
+ *
+ *	Add every match in the row to the set; false once it is full
+ */
+bool editorSearchRow(erow *row, int at, struct matchset *set, struct regexscan *rs)
+{
+	struct abuf text = ABUF_INIT;
+	const char *base = editorSearchRowText(row, &text), *hit;
+	int len = editor.search.len;
+	bool more = true;
+
+	if (rs != NULL)
+	{
+		if (len == 0 || editorSearchMem(base, row->size) != NULL)
+		{
+			more = editorRegexRow(rs, base, row->size, at, row->npieces <= 1, set);
+		}
+
+		abFree(&text);
+		return more;
+	}
+
+	for (hit = base; more && row->size >= len && (hit = editorSearchMem(hit, base + row->size - hit)) != NULL; hit++)
+	{
+		more = editorSearchAdd(set, at, hit - base, len, base + row->size - hit, (row->npieces <= 1) ? hit : NULL);
+	}
+
+	abFree(&text);
+
+	return more;
+}
+
+/**
+ *	editorRowInOrig
+ *
+ *	@param row editor row
+ *
+ *	Whether the row is still one piece of the original buffer
+ */
+bool editorRowInOrig(erow *row)
+{
+	uintptr_t start = (uintptr_t) editor.text.orig, at = (uintptr_t) row->piece.data;
+
+	return row->pieces == NULL && editor.text.orig != NULL && at >= start && \
+		at + row->size <= start + editor.text.origlen;
+}
+
+/**
+ *	editorSearchScan
+ *
+ *	@param start first row to search
+ *	@param stop row to stop before
+ *	@param set match set to add to
+ *
+ *	Add every match in rows start to stop to the set, false if it filled
+ *	up first. Rows that still sit one after another in the original
+ *	buffer, with only line breaks between them, are searched as a single
+ *	span, so an unedited file is scanned in one pass without rendering
+ *	anything. Only reads the rows, so workers can run it side by side.
+ */
+bool editorSearchScan(int start, int stop, struct matchset *set)
+{
+	struct regexscan rs;
+	bool more;
+
+	if (!editor.search.regex)
+	{
+		return editorSearchRows(start, stop, set, NULL);
+	}
+
+	editorRegexScanInit(&rs, &editor.search.re);
+	more = editorSearchRows(start, stop, set, &rs);
+	editorRegexScanFree(&rs);
+
+	return more;
+}
+
+/**
+ *	editorSearchRows
+ *
+ *	@param start first row to search
+ *	@param stop row to stop before
+ *	@param set match set to add to
+ *	@param rs matcher for a pattern, NULL for plain text
+ *
+ *	The body of editorSearchScan. With a pattern, hits of its literal
+ *	pick the rows it runs on; a pattern without one runs on every row.
+ */
+bool editorSearchRows(int start, int stop, struct matchset *set, struct regexscan *rs)
+{
+	erow *row = editorRowAt(start), *first, *next;
+	const char *end, *gap, *hit;
+	int at = start, n, i;
+
+	while (row != NULL && at < stop)
+	{
+		if (!editorRowInOrig(row) || (rs != NULL && editor.search.len == 0))
+		{
+			if (!editorSearchRow(row, at, set, rs))
+			{
+				return false;
+			}
+
+			row = editorRowNext(row);
+			at++;
+			continue;
+		}
+
+		first = row;
+		end = row->piece.data + row->size;
+		for (n = 1; at + n < stop && (next = editorRowNext(row)) != NULL && editorRowInOrig(next); n++)
+		{
+			for (gap = end; gap < next->piece.data && (*gap == '\n' || *gap == '\r'); gap++)
+			{
+			}
+
+			if (gap != next->piece.data)
+			{
+				break;
+			}
+
+			row = next;
+			end = row->piece.data + row->size;
+		}
+
+		// hits come in order, so one walk over the run maps them all to rows
+		next = first;
+		i = at;
+		for (hit = first->piece.data; (hit = editorSearchMem(hit, end - hit)) != NULL; hit++)
+		{
+			while (next != row && next->piece.data + next->size < hit + editor.search.len)
+			{
+				next = editorRowNext(next);
+				i++;
+			}
+
+			// a hit that runs across a line break belongs to no row
+			if (hit < next->piece.data || hit + editor.search.len > next->piece.data + next->size)
+			{
+				continue;
+			}
+
+			if (rs != NULL)
+			{
+				// one hit is enough to run the pattern over the whole row
+				if (!editorRegexRow(rs, next->piece.data, next->size, i, true, set))
+				{
+					return false;
+				}
+
+				hit = next->piece.data + next->size - 1;
+			}
+			else if (!editorSearchAdd(set, i, hit - next->piece.data, editor.search.len, \
+				next->piece.data + next->size - hit, hit))
+			{
+				return false;
+			}
+		}
+
+		at += n;
+		row = editorRowNext(row);
+	}
+
+	return true;
+}
+
+/**
+ *	editorSearchNarrow
+ *
+ *	@param none
+ *
+ *	Drop the matches the needle, now longer, no longer matches at. Pieces
+ *	don't move while the prompt is up, so most matches are checked where
+ *	they point without looking the row up.
+ */
+void editorSearchNarrow(void)
+{
+	struct search *s = &editor.search;
+	struct abuf text = ABUF_INIT;
+	struct match *m;
+	const char *p;
+	int i, j;
+
+	for (i = 0, j = 0; i < s->set.n; i++)
+	{
+		m = &s->set.m[i];
+		p = m->text;
+		if (p == NULL)
+		{
+			p = editorSearchRowText(editorRowAt(m->row), &text) + m->cx;
+		}
+
+		if (m->room >= s->len && editorSearchEqual(p))
+		{
+			m->len = s->len;
+			s->set.m[j++] = *m;
+		}
+	}
+
+	s->set.n = j;
+	abFree(&text);
+}
+
+/**
+ *	editorSearchPoolStart
+ *
+ *	@param none
+ *
+ *	Start the search workers, one per core, the first time a search is
+ *	big enough to share out. Returns false if none could be started.
+ */
+bool editorSearchPoolStart(void)
+{
+	struct searchpool *p = &editor.search.pool;
+	pthread_t thread;
+	long ncpu;
+
+	if (p->started)
+	{
+		return p->nthreads > 0;
+	}
+
+	p->started = true;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	ncpu = (ncpu < 1) ? 1 : (ncpu > SEARCH_THREADS_MAX) ? SEARCH_THREADS_MAX : ncpu;
+	while (p->nthreads < ncpu && pthread_create(&thread, NULL, editorSearchThread, NULL) == 0)
+	{
+		pthread_detach(thread);
+		p->nthreads++;
+	}
+
+	return p->nthreads > 0;
+}
+
+/**
+ *	editorSearchThread
+ *
+ *	@param arg unused
+ *
+ *	Search chunks of the job in the order they are handed out. The rows
+ *	are read without the editor lock; while a job is out the loader is
+ *	held back and nothing else changes the rows.
+ */
+void *editorSearchThread(void *arg)
+{
+	struct searchpool *p = &editor.search.pool;
+	struct matchset found;
+	int k, first, last;
+	bool full;
+
+	(void) arg;
+
+	pthread_mutex_lock(&p->lock);
+	while (true)
+	{
+		while (p->next >= p->nchunks)
+		{
+			pthread_cond_wait(&p->work, &p->lock);
+		}
+
+		k = p->next++;
+		p->busy++;
+		first = p->first + k * SEARCH_CHUNK_ROWS;
+		last = (p->last - first > SEARCH_CHUNK_ROWS) ? first + SEARCH_CHUNK_ROWS : p->last;
+		pthread_mutex_unlock(&p->lock);
+
+		memset(&found, 0, sizeof(found));
+		full = !editorSearchScan(first, last, &found);
+
+		pthread_mutex_lock(&p->lock);
+		p->chunks[k].found = found;
+		p->chunks[k].full = full;
+		p->chunks[k].done = true;
+		p->busy--;
+		pthread_cond_broadcast(&p->done);
+		editorWake('s');
+	}
+
+	return NULL;
+}
+
+/**
+ *	editorSearchStart
+ *
+ *	@param first row to search from
+ *
+ *	Search the rows from first to the end. A few chunks' worth is done
+ *	right here; more than that is split into chunks for the workers and
+ *	picked up in order by editorSearchCollect as they finish.
+ */
+void editorSearchStart(int first)
+{
+	struct search *s = &editor.search;
+	struct searchpool *p = &s->pool;
+	int last = editor.numrows;
+
+	if (first >= last)
+	{
+		return;
+	}
+
+	if (last - first <= SEARCH_CHUNK_ROWS || !editorSearchPoolStart())
+	{
+		if (editorSearchScan(first, last, &s->set))
+		{
+			s->scanned = last;
+		}
+		else
+		{
+			s->partial = true;
+		}
+
+		return;
+	}
+
+	editor.rows_pinned = true;
+	pthread_mutex_lock(&p->lock);
+	p->first = first;
+	p->last = last;
+	p->nchunks = (last - first + SEARCH_CHUNK_ROWS - 1) / SEARCH_CHUNK_ROWS;
+	p->next = 0;
+	p->collected = 0;
+	p->chunks = calloc(p->nchunks, sizeof(struct searchchunk));
+	if (p->chunks == NULL)
+	{
+		die("calloc");
+	}
+
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ *	editorSearchCancel
+ *
+ *	@param none
+ *
+ *	Stop the job: no more chunks are handed out, the ones being searched
+ *	are waited for and whatever wasn't collected is thrown away. The rows
+ *	collected so far stay in the set.
+ */
+void editorSearchCancel(void)
+{
+	struct searchpool *p = &editor.search.pool;
+	int k;
+
+	if (p->chunks == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->next = p->nchunks;
+	while (p->busy > 0)
+	{
+		pthread_cond_wait(&p->done, &p->lock);
+	}
+
+	for (k = p->collected; k < p->nchunks; k++)
+	{
+		free(p->chunks[k].found.m);
+	}
+
+	free(p->chunks);
+	p->chunks = NULL;
+	p->nchunks = 0;
+	p->next = 0;
+	p->collected = 0;
+	pthread_mutex_unlock(&p->lock);
+
+	editor.rows_pinned = false;
+	pthread_cond_signal(&editor.rows_unpinned);
+}
+
+/**
+ *	editorSearchCollect
+ *
+ *	@param none
+ *
+ *	Append the chunks that finished, in file order, to the match set and
+ *	start on rows the loader indexed since. Picks the current match once
+ *	there is one to pick. Returns whether anything changed.
+ */
+bool editorSearchCollect(void)
+{
+	struct search *s = &editor.search;
+	struct searchpool *p = &s->pool;
+	struct searchchunk *c;
+	struct match *new;
+	bool changed = false;
+	int n, take;
+
+	if (p->chunks != NULL)
+	{
+		pthread_mutex_lock(&p->lock);
+		while (!s->partial && p->collected < p->nchunks && p->chunks[p->collected].done)
+		{
+			c = &p->chunks[p->collected++];
+			take = (c->found.n < SEARCH_MATCH_MAX - s->set.n) ? c->found.n : SEARCH_MATCH_MAX - s->set.n;
+			if (s->set.n + take > s->set.cap)
+			{
+				s->set.cap = (s->set.cap * 2 > s->set.n + take) ? s->set.cap * 2 : s->set.n + take;
+				new = realloc(s->set.m, sizeof(struct match) * s->set.cap);
+				if (new == NULL)
+				{
+					die("realloc");
+				}
+
+				s->set.m = new;
+			}
+
+			if (take > 0)
+			{
+				memcpy(&s->set.m[s->set.n], c->found.m, sizeof(struct match) * take);
+				s->set.n += take;
+			}
+
+			s->partial = c->full || take < c->found.n;
+			free(c->found.m);
+			c->found.m = NULL;
+			s->scanned = (p->last - p->first > p->collected * SEARCH_CHUNK_ROWS) ? \
+				p->first + p->collected * SEARCH_CHUNK_ROWS : p->last;
+			changed = true;
+		}
+
+		n = p->collected;
+		pthread_mutex_unlock(&p->lock);
+
+		if (s->partial || n == p->nchunks)
+		{
+			editorSearchCancel();
+			changed = true;
+		}
+	}
+
+	// rows the loader indexed since the scan
+	if (p->chunks == NULL && s->valid && !s->partial && s->scanned < editor.numrows)
+	{
+		editorSearchStart(s->scanned);
+		changed = true;
+	}
+
+	if (s->current == -1)
+	{
+		editorSearchPick();
+	}
+
+	return changed;
+}
+
+/**
+ *	editorSearchPick
+ *
+ *	@param none
+ *
+ *	Make the first match at or after where the search started current.
+ *	Matches are in file order, so once the job is done and there is none
+ *	after it, the search wraps around to the first.
+ */
+void editorSearchPick(void)
+{
+	struct search *s = &editor.search;
+	int first = editorSearchFirst(s->from.row, s->from.cx);
+
+	if (first < s->set.n)
+	{
+		s->current = first;
+	}
+	else if (s->pool.chunks == NULL && s->set.n > 0)
+	{
+		s->current = 0;
+	}
+}
+
+/**
+ *	editorSearchFirst
+ *
+ *	@param row file row
+ *	@param cx char position in the row
+ *
+ *	Index of the first match at or after the position, set.n if none
+ */
+int editorSearchFirst(int row, int cx)
+{
+	struct match *m = editor.search.set.m;
+	int lo = 0, hi = editor.search.set.n, mid;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (m[mid].row < row || (m[mid].row == row && m[mid].cx < cx))
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/**
+ *	editorSearchWait
+ *
+ *	@param none
+ *
+ *	Collect the job until it is done
+ */
+void editorSearchWait(void)
+{
+	struct searchpool *p = &editor.search.pool;
+
+	while (p->chunks != NULL)
+	{
+		pthread_mutex_lock(&p->lock);
+		while (!p->chunks[p->collected].done)
+		{
+			pthread_cond_wait(&p->done, &p->lock);
+		}
+
+		pthread_mutex_unlock(&p->lock);
+		editorSearchCollect();
+	}
+}
+
+/**
+ *	editorRegexCompile
+ *
+ *	@param re regex to fill in
+ *	@param pattern extended regular expression
+ *	@param nocase whether letters match either case
+ *
+ *	Parse the pattern and build two programs from it, one that reads the
+ *	text forwards and one that reads it backwards. On failure re->error
+ *	says what is wrong and false is returned.
+ */
+bool editorRegexCompile(struct regex *re, const char *pattern, bool nocase)
+{
+	const char *p = pattern;
+	int match;
+
+	editorRegexFree(re);
+	re->nocase = nocase;
+	re->source = strdup(pattern);
+	if (re->source == NULL)
+	{
+		die("strdup");
+	}
+
+	re->root = editorRegexAlt(re, &p, 0);
+	if (re->root != -1 && *p != '\0')
+	{
+		re->error = "unmatched )";
+	}
+
+	if (re->error != NULL)
+	{
+		return false;
+	}
+
+	editorRegexClasses(re);
+	match = editorRegexState(re, NFA_MATCH, -1, -1, -1);
+	re->start[0] = editorRegexEmit(re, re->root, match, false);
+	re->start[1] = editorRegexEmit(re, re->root, match, true);
+
+	return re->error == NULL;
+}
+
+/**
+ *	editorRegexFree
+ *
+ *	@param re regex
+ *
+ */
+void editorRegexFree(struct regex *re)
+{
+	free(re->source);
+	free(re->nodes);
+	free(re->sets);
+	free(re->nfa);
+	memset(re, 0, sizeof(*re));
+	re->root = -1;
+}
+
+/**
+ *	editorRegexNode
+ *
+ *	@param re regex being parsed
+ *	@param op node type
+ *	@param left first operand, -1 if none
+ *	@param right second operand, -1 if none
+ *
+ */
+int editorRegexNode(struct regex *re, int op, int left, int right)
+{
+	struct renode *new;
+
+	if (re->nnodes == re->nodecap)
+	{
+		re->nodecap = (re->nodecap != 0) ? re->nodecap * 2 : 64;
+		new = realloc(re->nodes, sizeof(struct renode) * re->nodecap);
+		if (new == NULL)
+		{
+			die("realloc");
+		}
+
+		re->nodes = new;
+	}
+
+	new = &re->nodes[re->nnodes];
+	new->op = op;
+	new->left = left;
+	new->right = right;
+	new->set = -1;
+	new->min = 0;
+	new->max = 0;
+
+	return re->nnodes++;
+}
+
+/**
+ *	editorRegexSet
+ *
+ *	@param re regex being parsed
+ *
+ *	Add an empty byte set and a node matching it
+ */
+int editorRegexSet(struct regex *re)
+{
+	unsigned char (*new)[32];
+	int node;
+
+	if (re->nsets == re->setcap)
+	{
+		re->setcap = (re->setcap != 0) ? re->setcap * 2 : 16;
+		new = realloc(re->sets, sizeof(re->sets[0]) * re->setcap);
+		if (new == NULL)
+		{
+			die("realloc");
+		}
+
+		re->sets = new;
+	}
+
+	memset(re->sets[re->nsets], 0, sizeof(re->sets[0]));
+	node = editorRegexNode(re, RE_SET, -1, -1);
+	re->nodes[node].set = re->nsets++;
+
+	return node;
+}
+
+/**
+ *	editorRegexSetAdd
+ *
+ *	@param re regex being parsed
+ *	@param node set node
+ *	@param lo first byte
+ *	@param hi last byte
+ *
+ *	Add a range of bytes to the node's set, in both cases when case is
+ *	ignored
+ */
+void editorRegexSetAdd(struct regex *re, int node, int lo, int hi)
+{
+	unsigned char *set = re->sets[re->nodes[node].set];
+	int b, c;
+
+	for (b = lo; b <= hi; b++)
+	{
+		set[b >> 3] |= 1 << (b & 7);
+		if (re->nocase && isalpha(b))
+		{
+			c = isupper(b) ? tolower(b) : toupper(b);
+			set[c >> 3] |= 1 << (c & 7);
+		}
+	}
+}
+
+/**
+ *	editorRegexEscape
+ *
+ *	@param re regex being parsed
+ *	@param node set node
+ *	@param c letter after the backslash
+ *
+ *	Add \d, \w, \s or their upper case complements to the node's set.
+ *	Returns false for any other letter.
+ */
+bool editorRegexEscape(struct regex *re, int node, int c)
+{
+	unsigned char *set = re->sets[re->nodes[node].set];
+	int b, lc = tolower(c);
+	bool in;
+
+	if (lc != 'd' && lc != 'w' && lc != 's')
+	{
+		return false;
+	}
+
+	for (b = 0; b < 256; b++)
+	{
+		in = (lc == 'd') ? isdigit(b) : (lc == 'w') ? (isalnum(b) || b == '_') : isspace(b);
+		if (in != (bool) isupper(c))
+		{
+			set[b >> 3] |= 1 << (b & 7);
+		}
+	}
+
+	return true;
+}
+
+/**
+ *	editorRegexAlt
+ *
+ *	@param re regex being parsed
+ *	@param p parse position, moved past what was parsed
+ *	@param depth parentheses around this point
+ *
+ *	Parse alternatives separated by |. Parsing stops at the end or at an
+ *	unmatched ); -1 with re->error set on a syntax error.
+ */
+int editorRegexAlt(struct regex *re, const char **p, int depth)
+{
+	int node, right;
+
+	if (depth > REGEX_DEPTH_MAX)
+	{
+		re->error = "too deeply nested";
+		return -1;
+	}
+
+	node = editorRegexCat(re, p, depth);
+	while (node != -1 && **p == '|')
+	{
+		(*p)++;
+		right = editorRegexCat(re, p, depth);
+		node = (right != -1) ? editorRegexNode(re, RE_ALT, node, right) : -1;
+	}
+
+	return node;
+}
+
+/**
+ *	editorRegexCat
+ *
+ *	@param re regex being parsed
+ *	@param p parse position
+ *	@param depth parentheses around this point
+ *
+ *	Parse a sequence, which may be empty
+ */
+int editorRegexCat(struct regex *re, const char **p, int depth)
+{
+	int node = -1, right;
+
+	while (**p != '\0' && **p != '|' && **p != ')')
+	{
+		right = editorRegexRepeat(re, p, depth);
+		if (right == -1)
+		{
+			return -1;
+		}
+
+		node = (node != -1) ? editorRegexNode(re, RE_CAT, node, right) : right;
+	}
+
+	return (node != -1) ? node : editorRegexNode(re, RE_EMPTY, -1, -1);
+}
+
+/**
+ *	editorRegexRepeat
+ *
+ *	@param re regex being parsed
+ *	@param p parse position
+ *	@param depth parentheses around this point
+ *
+ *	Parse an atom and any *, +, ? or {min,max} after it
+ */
+int editorRegexRepeat(struct regex *re, const char **p, int depth)
+{
+	int node = editorRegexAtom(re, p, depth), min, max;
+
+	while (node != -1)
+	{
+		if (**p == '*' || **p == '+' || **p == '?')
+		{
+			min = (**p == '+') ? 1 : 0;
+			max = (**p == '?') ? 1 : -1;
+			(*p)++;
+		}
+		else if (**p != '{' || !editorRegexBraces(p, &min, &max))
+		{
+			break;
+		}
+
+		if (min > REGEX_REPEAT_MAX || max > REGEX_REPEAT_MAX)
+		{
+			re->error = "repeat count too big";
+			return -1;
+		}
+		else if (max != -1 && max < min)
+		{
+			re->error = "bad repeat count";
+			return -1;
+		}
+
+		node = editorRegexNode(re, RE_REPEAT, node, -1);
+		re->nodes[node].min = min;
+		re->nodes[node].max = max;
+	}
+
+	return node;
+}
+
+/**
+ *	editorRegexBraces
+ *
+ *	@param p parse position, on the {
+ *	@param min set to the least number of repeats
+ *	@param max set to the most, -1 for no limit
+ *
+ *	Parse {n}, {n,} or {n,m}. Anything else isn't a repeat count, the
+ *	brace is then matched literally.
+ */
+bool editorRegexBraces(const char **p, int *min, int *max)
+{
+	const char *q = *p + 1;
+	char *end;
+	long lo, hi;
+
+	if (!isdigit((unsigned char) *q))
+	{
+		return false;
+	}
+
+	lo = hi = strtol(q, &end, 10);
+	if (*end == ',')
+	{
+		q = end + 1;
+		if (*q == '}')
+		{
+			hi = -1;
+			end = (char *) q;
+		}
+		else if (isdigit((unsigned char) *q))
+		{
+			hi = strtol(q, &end, 10);
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	if (*end != '}')
+	{
+		return false;
+	}
+
+	*min = (lo > REGEX_REPEAT_MAX) ? REGEX_REPEAT_MAX + 1 : lo;
+	*max = (hi > REGEX_REPEAT_MAX) ? REGEX_REPEAT_MAX + 1 : hi;
+	*p = end + 1;
+
+	return true;
+}
+
+/**
+ *	editorRegexAtom
+ *
+ *	@param re regex being parsed
+ *	@param p parse position
+ *	@param depth parentheses around this point
+ *
+ *	Parse a group, a bracket expression, an anchor, . or a single byte,
+ *	which may be escaped
+ */
+int editorRegexAtom(struct regex *re, const char **p, int depth)
+{
+	int c = (unsigned char) *(*p)++, node;
+
+	if (c == '(')
+	{
+		node = editorRegexAlt(re, p, depth + 1);
+		if (node != -1 && **p != ')')
+		{
+			re->error = "missing )";
+			return -1;
+		}
+
+		(*p)++;
+		return node;
+	}
+	else if (c == '[')
+	{
+		return editorRegexClass(re, p);
+	}
+	else if (c == '^' || c == '$')
+	{
+		return editorRegexNode(re, (c == '^') ? RE_BOT : RE_EOT, -1, -1);
+	}
+	else if (c == '*' || c == '+' || c == '?')
+	{
+		re->error = "nothing to repeat";
+		return -1;
+	}
+
+	node = editorRegexSet(re);
+	if (c == '.')
+	{
+		editorRegexSetAdd(re, node, 0, 255);
+	}
+	else if (c == '\\')
+	{
+		c = (unsigned char) **p;
+		if (c == '\0')
+		{
+			re->error = "trailing backslash";
+			return -1;
+		}
+
+		(*p)++;
+		if (!editorRegexEscape(re, node, c))
+		{
+			c = (c == 't') ? '\t' : c;
+			editorRegexSetAdd(re, node, c, c);
+		}
+	}
+	else
+	{
+		editorRegexSetAdd(re, node, c, c);
+	}
+
+	return node;
+}
+
+/**
+ *	editorRegexPosix
+ *
+ *	@param re regex being parsed
+ *	@param node set node
+ *	@param p parse position, at the [ of [:name:]
+ *
+ *	Add a POSIX character class such as [:digit:] to the node's set and
+ *	move past it. Returns false with re->error set for an unknown name.
+ */
+bool editorRegexPosix(struct regex *re, int node, const char **p)
+{
+	static const struct
+	{
+		const char *name;
+		int (*is)(int);
+	} classes[] = {
+		{ "alpha", isalpha }, { "digit", isdigit }, { "alnum", isalnum }, { "space", isspace },
+		{ "upper", isupper }, { "lower", islower }, { "punct", ispunct }, { "xdigit", isxdigit }
+	};
+	const char *name = *p + 2, *end = strstr(name, ":]");
+	size_t i;
+	int b;
+
+	for (i = 0; end != NULL && i < sizeof(classes) / sizeof(classes[0]); i++)
+	{
+		if (strlen(classes[i].name) == (size_t) (end - name) && strncmp(name, classes[i].name, end - name) == 0)
+		{
+			for (b = 0; b < 256; b++)
+			{
+				if (classes[i].is(b))
+				{
+					editorRegexSetAdd(re, node, b, b);
+				}
+			}
+
+			*p = end + 2;
+			return true;
+		}
+	}
+
+	re->error = (end == NULL) ? "missing :]" : "unknown character class";
+	return false;
+}
+
+/**
+ *	editorRegexClass
+ *
+ *	@param re regex being parsed
+ *	@param p parse position, after the [
+ *
+ *	Parse a bracket expression: bytes, ranges, \d \w \s and [:name:]
+ *	classes, negated by a leading ^. A ] first in the list is taken
+ *	literally.
+ */
+int editorRegexClass(struct regex *re, const char **p)
+{
+	int node = editorRegexSet(re), lo, hi, b;
+	bool negate = (**p == '^'), first = true;
+	unsigned char *set;
+
+	if (negate)
+	{
+		(*p)++;
+	}
+
+	while (**p != ']' || first)
+	{
+		if (**p == '\0')
+		{
+			re->error = "missing ]";
+			return -1;
+		}
+
+		first = false;
+		if ((*p)[0] == '[' && (*p)[1] == ':')
+		{
+			if (!editorRegexPosix(re, node, p))
+			{
+				return -1;
+			}
+
+			continue;
+		}
+
+		lo = (unsigned char) *(*p)++;
+		if (lo == '\\' && **p != '\0')
+		{
+			lo = (unsigned char) *(*p)++;
+			if (editorRegexEscape(re, node, lo))
+			{
+				continue;
+			}
+
+			lo = (lo == 't') ? '\t' : lo;
+		}
+
+		hi = lo;
+		if ((*p)[0] == '-' && (*p)[1] != ']' && (*p)[1] != '\0')
+		{
+			hi = (unsigned char) (*p)[1];
+			*p += 2;
+			if (hi == '\\' && **p != '\0')
+			{
+				hi = (unsigned char) *(*p)++;
+				hi = (hi == 't') ? '\t' : hi;
+			}
+
+			if (hi < lo)
+			{
+				re->error = "bad range";
+				return -1;
+			}
+		}
+
+		editorRegexSetAdd(re, node, lo, hi);
+	}
+
+	(*p)++;
+	set = re->sets[re->nodes[node].set];
+	for (b = 0; negate && b < 32; b++)
+	{
+		set[b] = ~set[b];
+	}
+
+	return node;
+}
+
+/**
+ *	editorRegexClasses
+ *
+ *	@param re parsed regex
+ *
+ *	Split the bytes into classes no set tells apart, so the DFA needs a
+ *	column per class rather than per byte. Each class remembers one of
+ *	its bytes to stand for it.
+ */
+void editorRegexClasses(struct regex *re)
+{
+	unsigned char next[256];
+	int map[512], b, k, key, n = 1;
+
+	memset(re->cls, 0, sizeof(re->cls));
+	for (k = 0; k < re->nsets; k++)
+	{
+		for (b = 0; b < 512; b++)
+		{
+			map[b] = -1;
+		}
+
+		for (n = 0, b = 0; b < 256; b++)
+		{
+			key = re->cls[b] * 2 + ((re->sets[k][b >> 3] >> (b & 7)) & 1);
+			if (map[key] == -1)
+			{
+				map[key] = n++;
+			}
+
+			next[b] = map[key];
+		}
+
+		memcpy(re->cls, next, sizeof(next));
+	}
+
+	re->nclasses = n;
+	for (b = 255; b >= 0; b--)
+	{
+		re->rep[re->cls[b]] = b;
+	}
+}
+
+/**
+ *	editorRegexState
+ *
+ *	@param re regex being compiled
+ *	@param op state type
+ *	@param out next state
+ *	@param out1 other next state of a split
+ *	@param set byte set to match, for NFA_SET
+ *
+ *	Add an NFA state. Past REGEX_NFA_MAX the pattern is refused.
+ */
+int editorRegexState(struct regex *re, int op, int out, int out1, int set)
+{
+	struct nfastate *new;
+
+	if (re->nnfa == REGEX_NFA_MAX)
+	{
+		re->error = "pattern too big";
+		return out;
+	}
+
+	if (re->nnfa == re->nfacap)
+	{
+		re->nfacap = (re->nfacap != 0) ? re->nfacap * 2 : 64;
+		new = realloc(re->nfa, sizeof(struct nfastate) * re->nfacap);
+		if (new == NULL)
+		{
+			die("realloc");
+		}
+
+		re->nfa = new;
+	}
+
+	new = &re->nfa[re->nnfa];
+	new->op = op;
+	new->out = out;
+	new->out1 = out1;
+	new->set = set;
+
+	return re->nnfa++;
+}
+
+/**
+ *	editorRegexEmit
+ *
+ *	@param re regex being compiled
+ *	@param node syntax tree node
+ *	@param next state to go on to after the node matched
+ *	@param reverse build the program for text read backwards
+ *
+ *	Build the states for a node back to front and return its first one.
+ *	Reading backwards swaps the order of a sequence and the two anchors.
+ */
+int editorRegexEmit(struct regex *re, int node, int next, bool reverse)
+{
+	struct renode n = re->nodes[node];
+	int k, loop, body;
+
+	if (re->error != NULL)
+	{
+		return next;
+	}
+
+	switch (n.op)
+	{
+		case RE_SET:
+		{
+			return editorRegexState(re, NFA_SET, next, -1, n.set);
+		}
+		case RE_BOT:
+		case RE_EOT:
+		{
+			return editorRegexState(re, ((n.op == RE_BOT) != reverse) ? NFA_BOT : NFA_EOT, next, -1, -1);
+		}
+		case RE_CAT:
+		{
+			if (reverse)
+			{
+				return editorRegexEmit(re, n.right, editorRegexEmit(re, n.left, next, reverse), reverse);
+			}
+
+			return editorRegexEmit(re, n.left, editorRegexEmit(re, n.right, next, reverse), reverse);
+		}
+		case RE_ALT:
+		{
+			body = editorRegexEmit(re, n.left, next, reverse);
+			return editorRegexState(re, NFA_SPLIT, body, editorRegexEmit(re, n.right, next, reverse), -1);
+		}
+		case RE_REPEAT:
+		{
+			// optional copies first, each one able to skip to next
+			if (n.max == -1)
+			{
+				loop = editorRegexState(re, NFA_SPLIT, -1, next, -1);
+				body = editorRegexEmit(re, n.left, loop, reverse);
+				if (re->error == NULL)
+				{
+					re->nfa[loop].out = body;
+				}
+
+				next = loop;
+			}
+
+			for (k = n.min, body = next; k < n.max; k++)
+			{
+				body = editorRegexState(re, NFA_SPLIT, editorRegexEmit(re, n.left, body, reverse), next, -1);
+			}
+
+			for (k = 0, next = body; k < n.min; k++)
+			{
+				next = editorRegexEmit(re, n.left, next, reverse);
+			}
+
+			return next;
+		}
+		default:
+		{
+			return next;
+		}
+	}
+}
+
+/**
+ *	editorRegexLiteral
+ *
+ *	@param re compiled regex
+ *
+ *	The longest run of bytes every match has to contain, for the
+ *	substring scanner to find candidate rows with; lower cased when case
+ *	is ignored and empty if there is none
+ */
+char *editorRegexLiteral(struct regex *re)
+{
+	struct abuf best = ABUF_INIT;
+	char *literal;
+
+	if (re->error == NULL && re->root != -1)
+	{
+		editorRegexRequired(re, re->root, &best);
+	}
+
+	literal = malloc(best.len + 1);
+	if (literal == NULL)
+	{
+		die("malloc");
+	}
+
+	if (best.len > 0)
+	{
+		memcpy(literal, best.b, best.len);
+	}
+
+	literal[best.len] = '\0';
+	abFree(&best);
+
+	return literal;
+}
+
+/**
+ *	editorRegexRequired
+ *
+ *	@param re compiled regex
+ *	@param node syntax tree node
+ *	@param best longest required run found so far
+ *
+ *	Look for runs of single bytes in the node's sequence. A repeat that
+ *	has to match at least once is searched too; alternatives are not.
+ */
+void editorRegexRequired(struct regex *re, int node, struct abuf *best)
+{
+	struct abuf run = ABUF_INIT;
+
+	editorRegexFactors(re, node, &run, best);
+	editorRegexKeep(&run, best);
+	abFree(&run);
+}
+
+/**
+ *	editorRegexFactors
+ *
+ *	@param re compiled regex
+ *	@param node syntax tree node
+ *	@param run single bytes just before the node
+ *	@param best longest required run found so far
+ *
+ */
+void editorRegexFactors(struct regex *re, int node, struct abuf *run, struct abuf *best)
+{
+	struct renode *n = &re->nodes[node];
+	int c;
+
+	if (n->op == RE_CAT)
+	{
+		editorRegexFactors(re, n->left, run, best);
+		editorRegexFactors(re, n->right, run, best);
+		return;
+	}
+	else if (n->op == RE_SET && (c = editorRegexSingle(re, n->set)) != -1)
+	{
+		abAppendByte(run, c);
+		return;
+	}
+
+	editorRegexKeep(run, best);
+	if (n->op == RE_REPEAT && n->min > 0)
+	{
+		editorRegexRequired(re, n->left, best);
+	}
+}
+
+/**
+ *	editorRegexKeep
+ *
+ *	@param run run that just ended, emptied
+ *	@param best longest run so far
+ *
+ */
+void editorRegexKeep(struct abuf *run, struct abuf *best)
+{
+	if (run->len > best->len)
+	{
+		abReset(best);
+		abAppend(best, run->b, run->len);
+	}
+
+	abReset(run);
+}
+
+/**
+ *	editorRegexSingle
+ *
+ *	@param re compiled regex
+ *	@param set index of a byte set
+ *
+ *	The one byte the set holds, or the lower case letter when case is
+ *	ignored and it holds both cases of one; -1 otherwise
+ */
+int editorRegexSingle(struct regex *re, int set)
+{
+	int b, n = 0, c = -1, other = -1;
+
+	for (b = 0; b < 256; b++)
+	{
+		if ((re->sets[set][b >> 3] >> (b & 7)) & 1)
+		{
+			if (++n > 2)
+			{
+				return -1;
+			}
+
+			if (c == -1)
+			{
+				c = b;
+			}
+			else
+			{
+				other = b;
+			}
+		}
+	}
+
+	if (n == 1)
+	{
+		return c;
+	}
+
+	return (n == 2 && re->nocase && isupper(c) && other == tolower(c)) ? other : -1;
+}
+
+/**
+ *	editorDfaInit
+ *
+ *	@param d DFA to set up
+ *	@param re compiled regex
+ *	@param reverse run the backwards program, unanchored: every state
+ *	also holds the start, so it reports every place a match begins
+ *
+ *	DFA states are built from NFA state sets as the text first needs
+ *	them and cached, so each byte is one table lookup once warm. A row of
+ *	the table has a column per byte class, two for the anchors and one
+ *	saying whether the state accepts; transitions hold the offset of the
+ *	next row rather than its number, which saves a multiply per byte.
+ */
+void editorDfaInit(struct dfa *d, const struct regex *re, bool reverse)
+{
+	memset(d, 0, sizeof(*d));
+	d->re = re;
+	d->entry = re->start[reverse];
+	d->floating = reverse;
+	d->stride = re->nclasses + 3;
+	d->stack = malloc(sizeof(int) * (2 * re->nnfa + 1));
+	d->scratch = malloc(sizeof(int) * re->nnfa);
+	d->mark = calloc(re->nnfa, sizeof(int));
+	if (d->stack == NULL || d->scratch == NULL || d->mark == NULL)
+	{
+		die("malloc");
+	}
+
+	editorDfaGrow(d);
+	editorDfaReset(d);
+}
+
+/**
+ *	editorDfaFree
+ *
+ *	@param d DFA
+ *
+ */
+void editorDfaFree(struct dfa *d)
+{
+	free(d->trans);
+	free(d->setoff);
+	free(d->setlen);
+	free(d->pool);
+	free(d->hash);
+	free(d->stack);
+	free(d->scratch);
+	free(d->mark);
+}
+
+/**
+ *	editorDfaReset
+ *
+ *	@param d DFA
+ *
+ *	Forget every state. State 0 is always the empty set, which no text
+ *	gets out of.
+ */
+void editorDfaReset(struct dfa *d)
+{
+	int i;
+
+	d->nstates = 0;
+	d->poolused = 0;
+	d->resets++;
+	d->begin[0] = -1;
+	d->begin[1] = -1;
+	for (i = 0; i < d->hashcap; i++)
+	{
+		d->hash[i] = -1;
+	}
+
+	editorDfaIntern(d, NULL, 0);
+}
+
+/**
+ *	editorDfaHash
+ *
+ *	@param set sorted NFA states
+ *	@param n number of states
+ *
+ */
+unsigned int editorDfaHash(const int *set, int n)
+{
+	unsigned int h = 2166136261u;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		h = (h ^ (unsigned int) set[i]) * 16777619u;
+	}
+
+	return h;
+}
+
+/**
+ *	editorDfaGrow
+ *
+ *	@param d DFA
+ *
+ *	Make room for twice as many states and rehash them
+ */
+void editorDfaGrow(struct dfa *d)
+{
+	int i, st;
+	unsigned int h;
+
+	d->cap = (d->cap != 0) ? d->cap * 2 : 64;
+	d->trans = realloc(d->trans, sizeof(int) * d->cap * d->stride);
+	d->setoff = realloc(d->setoff, sizeof(int) * d->cap);
+	d->setlen = realloc(d->setlen, sizeof(int) * d->cap);
+	free(d->hash);
+	d->hashcap = d->cap * 2;
+	d->hash = malloc(sizeof(int) * d->hashcap);
+	if (d->trans == NULL || d->setoff == NULL || d->setlen == NULL || d->hash == NULL)
+	{
+		die("realloc");
+	}
+
+	for (i = 0; i < d->hashcap; i++)
+	{
+		d->hash[i] = -1;
+	}
+
+	for (st = 0; st < d->nstates; st++)
+	{
+		h = editorDfaHash(&d->pool[d->setoff[st]], d->setlen[st]);
+		for (i = h & (d->hashcap - 1); d->hash[i] != -1; i = (i + 1) & (d->hashcap - 1))
+		{
+		}
+
+		d->hash[i] = st;
+	}
+}
+
+/**
+ *	editorDfaIntern
+ *
+ *	@param d DFA
+ *	@param set sorted NFA states
+ *	@param n number of states
+ *
+ *	The DFA state for a set of NFA states, added if it is new; -1 when
+ *	the cache is full
+ */
+int editorDfaIntern(struct dfa *d, const int *set, int n)
+{
+	unsigned int h = editorDfaHash(set, n);
+	int i, st;
+
+	for (i = h & (d->hashcap - 1); (st = d->hash[i]) != -1; i = (i + 1) & (d->hashcap - 1))
+	{
+		if (d->setlen[st] == n && (n == 0 || memcmp(&d->pool[d->setoff[st]], set, sizeof(int) * n) == 0))
+		{
+			return st;
+		}
+	}
+
+	if (d->nstates == DFA_STATES_MAX)
+	{
+		return -1;
+	}
+
+	if (d->nstates == d->cap)
+	{
+		editorDfaGrow(d);
+	}
+
+	if (d->poolused + n > d->poolcap)
+	{
+		d->poolcap = (d->poolcap * 2 > d->poolused + n) ? d->poolcap * 2 : d->poolused + n + 256;
+		d->pool = realloc(d->pool, sizeof(int) * d->poolcap);
+		if (d->pool == NULL)
+		{
+			die("realloc");
+		}
+	}
+
+	st = d->nstates++;
+	d->setoff[st] = d->poolused;
+	d->setlen[st] = n;
+	for (i = 0; i < d->stride - 1; i++)
+	{
+		d->trans[st * d->stride + i] = -1;
+	}
+
+	d->trans[st * d->stride + d->stride - 1] = 0;
+	for (i = 0; i < n; i++)
+	{
+		d->pool[d->poolused++] = set[i];
+		d->trans[st * d->stride + d->stride - 1] |= (d->re->nfa[set[i]].op == NFA_MATCH);
+	}
+
+	for (i = h & (d->hashcap - 1); d->hash[i] != -1; i = (i + 1) & (d->hashcap - 1))
+	{
+	}
+
+	d->hash[i] = st;
+
+	return st;
+}
+
+/**
+ *	editorDfaCompare
+ *
+ *	@param a NFA state
+ *	@param b NFA state
+ *
+ */
+int editorDfaCompare(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+/**
+ *	editorDfaClosure
+ *
+ *	@param d DFA
+ *	@param id NFA state
+ *	@param pass anchor being stepped over, which is followed as well as
+ *	kept, -1 for none
+ *
+ *	Add the state to the scratch set, following splits
+ */
+void editorDfaClosure(struct dfa *d, int id, int pass)
+{
+	const struct nfastate *nfa = d->re->nfa;
+	int sp = 0;
+
+	d->stack[sp++] = id;
+	while (sp > 0)
+	{
+		id = d->stack[--sp];
+		if (id < 0 || d->mark[id] == d->gen)
+		{
+			continue;
+		}
+
+		d->mark[id] = d->gen;
+		if (nfa[id].op == NFA_SPLIT)
+		{
+			d->stack[sp++] = nfa[id].out1;
+			d->stack[sp++] = nfa[id].out;
+			continue;
+		}
+
+		d->scratch[d->nscratch++] = id;
+		if (nfa[id].op == pass)
+		{
+			d->stack[sp++] = nfa[id].out;
+		}
+	}
+}
+
+/**
+ *	editorDfaClear
+ *
+ *	@param d DFA
+ *
+ *	Start a new scratch set
+ */
+void editorDfaClear(struct dfa *d)
+{
+	d->nscratch = 0;
+	if (++d->gen == INT_MAX)
+	{
+		memset(d->mark, 0, sizeof(int) * d->re->nnfa);
+		d->gen = 1;
+	}
+}
+
+/**
+ *	editorDfaSettle
+ *
+ *	@param d DFA
+ *
+ *	The state for the scratch set. A full cache is emptied first, which
+ *	invalidates every state the caller held.
+ */
+int editorDfaSettle(struct dfa *d)
+{
+	int st;
+
+	if (d->floating)
+	{
+		editorDfaClosure(d, d->entry, -1);
+	}
+
+	qsort(d->scratch, d->nscratch, sizeof(int), editorDfaCompare);
+	st = editorDfaIntern(d, d->scratch, d->nscratch);
+	if (st == -1)
+	{
+		editorDfaReset(d);
+		st = editorDfaIntern(d, d->scratch, d->nscratch);
+	}
+
+	return st;
+}
+
+/**
+ *	editorDfaStep
+ *
+ *	@param d DFA
+ *	@param st current state
+ *	@param c byte class, or nclasses and nclasses + 1 for the start and
+ *	end of the row, which take no room: states get past the anchor for
+ *	it and also stay put
+ *
+ *	Work out and cache a transition the table doesn't have yet
+ */
+int editorDfaStep(struct dfa *d, int st, int c)
+{
+	const struct regex *re = d->re;
+	const struct nfastate *ns;
+	int i, id, to, b = re->rep[(c < re->nclasses) ? c : 0], resets = d->resets;
+
+	editorDfaClear(d);
+	for (i = 0; i < d->setlen[st]; i++)
+	{
+		id = d->pool[d->setoff[st] + i];
+		ns = &re->nfa[id];
+		if (c >= re->nclasses)
+		{
+			editorDfaClosure(d, id, (c == re->nclasses) ? NFA_BOT : NFA_EOT);
+		}
+		else if (ns->op == NFA_SET && ((re->sets[ns->set][b >> 3] >> (b & 7)) & 1))
+		{
+			editorDfaClosure(d, ns->out, -1);
+		}
+	}
+
+	to = editorDfaSettle(d);
+	if (d->resets == resets)
+	{
+		d->trans[st * d->stride + c] = to * d->stride;
+	}
+
+	return to;
+}
+
+/**
+ *	editorDfaNext
+ *
+ *	@param d DFA
+ *	@param at offset of the current state's row
+ *	@param c byte class or anchor
+ *
+ *	Offset of the next state's row
+ */
+int editorDfaNext(struct dfa *d, int at, int c)
+{
+	int next = d->trans[at + c];
+
+	return (next != -1) ? next : editorDfaStep(d, at / d->stride, c) * d->stride;
+}
+
+/**
+ *	editorDfaBegin
+ *
+ *	@param d DFA
+ *	@param bot whether the text starts at the start of the row
+ *
+ */
+int editorDfaBegin(struct dfa *d, bool bot)
+{
+	int st;
+
+	if (d->begin[bot] != -1)
+	{
+		return d->begin[bot];
+	}
+
+	editorDfaClear(d);
+	editorDfaClosure(d, d->entry, -1);
+	st = editorDfaSettle(d);
+	if (bot)
+	{
+		st = editorDfaStep(d, st, d->re->nclasses);
+	}
+
+	d->begin[bot] = st;
+
+	return st;
+}
+
+/**
+ *	editorRegexScanInit
+ *
+ *	@param rs matcher to set up
+ *	@param re compiled regex, read only from here on
+ *
+ *	Each scan gets its own DFAs, so workers never share a cache
+ */
+void editorRegexScanInit(struct regexscan *rs, const struct regex *re)
+{
+	editorDfaInit(&rs->forward, re, false);
+	editorDfaInit(&rs->reverse, re, true);
+	rs->marks = NULL;
+	rs->nmarks = 0;
+	rs->markcap = 0;
+}
+
+/**
+ *	editorRegexScanFree
+ *
+ *	@param rs matcher
+ *
+ */
+void editorRegexScanFree(struct regexscan *rs)
+{
+	editorDfaFree(&rs->forward);
+	editorDfaFree(&rs->reverse);
+	free(rs->marks);
+}
+
+/**
+ *	editorRegexRow
+ *
+ *	@param rs matcher
+ *	@param text the row's text
+ *	@param size length of the row
+ *	@param at index of the row
+ *	@param inpiece whether text is where the row's piece is
+ *	@param set match set to add to
+ *
+ *	Add the leftmost longest matches in the row to the set; false once it
+ *	is full. One pass backwards marks every place a match starts, then
+ *	each match is run forwards from the first mark past the last one for
+ *	its end. Both passes are linear in the row, whatever the pattern.
+ */
+bool editorRegexRow(struct regexscan *rs, const char *text, int size, int at, bool inpiece, \
+	struct matchset *set)
+{
+	struct dfa *d = &rs->reverse;
+	const unsigned char *t = (const unsigned char *) text, *cls = d->re->cls;
+	int cur, next, i, k, end, pos = 0, accept = d->stride - 1, *trans;
+
+	if (size == 0)
+	{
+		return true;
+	}
+
+	rs->nmarks = 0;
+	cur = editorDfaBegin(d, true) * d->stride;
+	trans = d->trans;
+	for (i = size - 1; i >= 0; i--)
+	{
+		next = trans[cur + cls[t[i]]];
+		if (next == -1)
+		{
+			// the table may move as states are added
+			next = editorDfaNext(d, cur, cls[t[i]]);
+			trans = d->trans;
+		}
+
+		cur = next;
+		if (trans[cur + accept])
+		{
+			editorRegexMark(rs, i);
+		}
+	}
+
+	// a match anchored with ^ only shows up once the row start is seen
+	cur = editorDfaNext(d, cur, d->stride - 2);
+	if (d->trans[cur + accept] && (rs->nmarks == 0 || rs->marks[rs->nmarks - 1] != 0))
+	{
+		editorRegexMark(rs, 0);
+	}
+
+	for (k = rs->nmarks - 1; k >= 0; k--)
+	{
+		i = rs->marks[k];
+		if (i < pos || (end = editorRegexLongest(&rs->forward, t, size, i)) <= i)
+		{
+			continue;
+		}
+
+		if (!editorSearchAdd(set, at, i, end - i, size - i, inpiece ? text + i : NULL))
+		{
+			return false;
+		}
+
+		pos = end;
+	}
+
+	return true;
+}
+
+/**
+ *	editorRegexMark
+ *
+ *	@param rs matcher
+ *	@param i offset where a match starts
+ *
+ */
+void editorRegexMark(struct regexscan *rs, int i)
+{
+	if (rs->nmarks == rs->markcap)
+	{
+		rs->markcap = (rs->markcap != 0) ? rs->markcap * 2 : 64;
+		rs->marks = realloc(rs->marks, sizeof(int) * rs->markcap);
+		if (rs->marks == NULL)
+		{
+			die("realloc");
+		}
+	}
+
+	rs->marks[rs->nmarks++] = i;
+}
+
+/**
+ *	editorRegexLongest
+ *
+ *	@param d forward DFA
+ *	@param t row text
+ *	@param size length of the row
+ *	@param start offset to match from
+ *
+ *	End of the longest match starting at start, -1 if there is none
+ */
+int editorRegexLongest(struct dfa *d, const unsigned char *t, int size, int start)
+{
+	const unsigned char *cls = d->re->cls;
+	int at = editorDfaBegin(d, start == 0) * d->stride, i, end = -1;
+
+	// state 0 is the dead one, no match gets past it
+	for (i = start; i < size && at != 0; i++)
+	{
+		at = editorDfaNext(d, at, cls[t[i]]);
+		if (d->trans[at + d->stride - 1])
+		{
+			end = i + 1;
+		}
+	}
+
+	if (i == size && at != 0)
+	{
+		at = editorDfaNext(d, at, d->stride - 2);
+		end = d->trans[at + d->stride - 1] ? size : end;
+	}
+
+	return end;
+}
+
+/**
+ *	editorFind
+ * 
+ * 	@param none
+ *
+ */
+void editorFind(void)
+{
+	char *query = NULL;
+	int saved_cx = editor.cx;
+	int saved_cy = editor.cy;
+	int saved_rowoff = editor.rowoff;
+	int saved_coloff = editor.coloff;
+
+	// the callback rewrites the prompt in place when an option changes
+	editorSearchPrompt();
+	query = editorPrompt(editor.search.prompt, editorFindCallback);
+
+	if (query != NULL)
+	{
+		free(query);
+	}
+	else
+	{
+		editor.cx = saved_cx;
+		editor.cy = saved_cy;
+		editor.rowoff = saved_rowoff;
+		editor.coloff = saved_coloff;
+	}
+}
+
+/**
+ *	editorReplace
+ *
+ *	@param none
+ *
+ *	Ask for what to look for, with the same live matching as editorFind,
+ *	then for the replacement, and replace every match
+ */
+void editorReplace(void)
+{
+	struct search *s = &editor.search;
+	char *query, *with, prompt[240];
+	int i, n;
+	int saved_cx = editor.cx;
+	int saved_cy = editor.cy;
+	int saved_rowoff = editor.rowoff;
+	int saved_coloff = editor.coloff;
+
+	if (editor.loading)
+	{
+		editorSetStatusMessage("Can't replace while the file is loading");
+		return;
+	}
+
+	s->replacing = true;
+	editorSearchPrompt();
+	query = editorPrompt(s->prompt, editorFindCallback);
+	s->replacing = false;
+	if (query == NULL)
+	{
+		editor.cx = saved_cx;
+		editor.cy = saved_cy;
+		editor.rowoff = saved_rowoff;
+		editor.coloff = saved_coloff;
+		return;
+	}
+
+	// the prompt is used as a format, so a % in the query is doubled
+	n = snprintf(prompt, sizeof(prompt), "Replace ");
+	for (i = 0; query[i] != '\0' && i < 100; i++)
+	{
+		if (query[i] == '%')
+		{
+			prompt[n++] = '%';
+		}
+
+		prompt[n++] = query[i];
+	}
+
+	snprintf(prompt + n, sizeof(prompt) - n, " with: %%s (ESC to cancel)");
+	with = editorPrompt(prompt, NULL);
+	if (with != NULL)
+	{
+		editorSearchCompile(query);
+		if (s->re.error == NULL)
+		{
+			editorReplaceAll(with);
+		}
+
+		editorRegexFree(&s->re);
+		free(with);
+	}
+
+	free(query);
+}
+
+/**
+ *	editorReplaceAll
+ *
+ *	@param with replacement text
+ *
+ *	Replace every match of the compiled search in one pass over the file.
+ *	Rows are searched a chunk at a time the same way a search is, then
+ *	each row with matches is rebuilt once, straight into the add buffer,
+ *	and marked for rendering and highlighting again; rows without a match
+ *	are left alone. Overlapping matches only replace the first of them,
+ *	and a single row with more than SEARCH_MATCH_MAX matches only has
+ *	that many replaced, since searching it again could find the new text.
+ */
+void editorReplaceAll(const char *with)
+{
+	struct search *s = &editor.search;
+	struct matchset set = {NULL, 0, 0};
+	struct abuf text = ABUF_INIT;
+	struct match *m, *next, *end;
+	struct piece p;
+	const char *src, *old;
+	int start, stop, at, cx, len, rlen = strlen(with), count = 0, rows = 0, cut = 0;
+	bool full;
+	erow *row;
+	char *dst;
+
+	editorSearchCancel();
+	for (start = 0; start < editor.numrows; start = stop)
+	{
+		stop = (editor.numrows - start > SEARCH_CHUNK_ROWS) ? start + SEARCH_CHUNK_ROWS : editor.numrows;
+		set.n = 0;
+		full = !editorSearchScan(start, stop, &set);
+
+		// a full set may end part way through a row; that row goes again
+		if (full && set.m[0].row != set.m[set.n - 1].row)
+		{
+			stop = set.m[set.n - 1].row;
+			while (set.m[set.n - 1].row == stop)
+			{
+				set.n--;
+			}
+		}
+		else if (full)
+		{
+			stop = set.m[0].row + 1;
+			cut++;
+		}
+
+		row = editorRowAt(start);
+		at = start;
+		for (m = set.m, end = set.m + set.n; m < end; m = next)
+		{
+			for (; at < m->row; at++)
+			{
+				row = editorRowNext(row);
+			}
+
+			// size the new row first so it is written exactly once
+			len = row->size;
+			for (next = m, cx = 0; next < end && next->row == at; next++)
+			{
+				if (next->cx >= cx && next->len > 0)
+				{
+					len += rlen - next->len;
+					cx = next->cx + next->len;
+				}
+			}
+
+			src = editorSearchRowText(row, &text);
+			p.data = dst = editorTextReserve(len);
+			p.len = len;
+			for (cx = 0; m < next; m++)
+			{
+				if (m->cx >= cx && m->len > 0)
+				{
+					memcpy(dst, src + cx, m->cx - cx);
+					dst += m->cx - cx;
+					memcpy(dst, with, rlen);
+					dst += rlen;
+					cx = m->cx + m->len;
+					count++;
+				}
+			}
+
+			memcpy(dst, src + cx, row->size - cx);
+
+			// undo points at the old text, which only has to be copied if it was in
+			// pieces; text in the original file is copied by editorUndoRebase on save
+			if (editorUndoActive())
+			{
+				old = (row->npieces > 1) ? editorTextAppend(src, row->size) : editorRowPieces(row)[0].data;
+				editorUndoRecord(UNDO_DELETE, at, 0, old, row->size, true);
+				editorUndoRecord(UNDO_INSERT, at, 0, p.data, len, true);
+			}
+
+			editorRowTruncate(row, 0);
+			editorRowInsertPieces(row, 0, &p, 1);
+			editorUpdateRowAt(row, at);
+			rows++;
+		}
+	}
+
+	free(set.m);
+	abFree(&text);
+
+	s->valid = false;
+	s->set.n = 0;
+	s->current = -1;
+	if (editor.cy < editor.numrows && editor.cx > editorRowAt(editor.cy)->size)
+	{
+		editor.cx = editorRowAt(editor.cy)->size;
+	}
+
+	if (count > 0)
+	{
+		editor.dirty++;
+	}
+
+	editorSetStatusMessage("Replaced %d match%s on %d row%s%s", count, (count == 1) ? "" : "es", \
+		rows, (rows == 1) ? "" : "s", (cut > 0) ? ", some rows had too many to replace them all" : "");
+}
+
+/**
+ *	editorMoveCursor
+ *
+ *	@param key keypad character
+ *
+ *	handles wasd key press
+ */
+char *editorPrompt(char *prompt, void(*callback)(char *, int))
+{
+	size_t bufsize = 128, buflen = 0;
+	char *buf = malloc(bufsize);
+	int ch;
+
+	buf[0] = '\0';
+	while (1)
+	{
+		editorSetStatusMessage(prompt, buf);
+		if (!editorInputPending())
+		{
+			editorRefreshScreen();
+		}
+
+		ch = editorReadKey();
+		if (ch == DEL_KEY || ch == CTRL_KEY('h') || ch == BACKSPACE)
+		{
+			if (buflen != 0)
+			{
+				buf[--buflen] = '\0';
+			}
+		}
+		else if (ch == '\x1b')
+		{
+			editorSetStatusMessage("");
+			if (callback)
+			{
+				callback(buf, ch);
+			}
+
+			free(buf);
+			return NULL;
+		}
+		else if (ch == '\r')
+		{
+			if (buflen != 0)
+			{
+				editorSetStatusMessage("");
+				if (callback)
+				{
+					callback(buf, ch);
+				}
+
+				return buf;
+			}
+		}
+		else if (!iscntrl(ch) && ch < 128)
+		{
+			if (buflen == bufsize - 1)
+			{
+				bufsize *= 2;
+				buf = realloc(buf, bufsize);
+			}
+
+			buf[buflen++] = ch;
+			buf[buflen] = '\0';
+		}
+
+		if (callback)
+		{
+			callback(buf, ch);
+		}
+	}
+}
+
+/**
+ *	editorMoveCursor
+ *
+ *	@param key keypad character
+ *
+ *	handles wasd key press
+ */
+void editorMoveCursor(int key)
+{
+	erow * row;
+	int rowlen;
+
+	editorIndexRows(editor.cy + 2);
+
+	if (editor.cy >= editor.numrows)
+	{
+		row = NULL;
+	}
+	else
+	{
+		row = editorRowAt(editor.cy);
+	}
+
+	switch (key)
+	{
+		case ARROW_LEFT:
+			{
+				if (editor.cx != 0)
+				{
+					editor.cx--;
+				}
+				else if (editor.cy > 0)
+				{
+					editor.cy--;
+					editor.cx = editorRowAt(editor.cy)->size;
+				}
+
+				break;
+			}
+
+		case ARROW_RIGHT:
+			{
+				if (row != NULL && editor.cx < row->size)
+				{
+					editor.cx++;
+				}
+				else if (row != NULL && editor.cx == row->size)
+				{
+					editor.cy++;
+					editor.cx = 0;
+				}
+
+				break;
+			}
+
+		case ARROW_DOWN:
+			{
+				if (editor.cy < editor.numrows)
+				{
+					editor.cy++;
+				}
+
+				break;
+			}
+
+		case ARROW_UP:
+			{
+				if (editor.cy != 0)
+				{
+					editor.cy--;
+				}
+
+				break;
+			}
+	}
+
+	if (editor.cy >= editor.numrows)
+	{
+		row = NULL;
+	}
+	else
+	{
+		row = editorRowAt(editor.cy);
+	}
+
+	if (row != NULL)
+	{
+		rowlen = row->size;
+	}
+	else
+	{
+		rowlen = 0;
+	}
+
+	if (editor.cx > rowlen)
+	{
+		editor.cx = rowlen;
+	}
+}
+
+/**
+ *	editorProcessKeypress
+ *
+ *	@param none
+ * 
+ *	handles key press from editorReadKey()
+ */
+void editorProcessKeypress(void)
+{
+	static int quit_times = QUIT_TIMES;
+	int ch = editorReadKey();
+	int times;
+
+	// every edit made for this key is one undo step
+	editor.undo.key++;
+	switch (ch)
+	{
+		case '\r':
+			{
+				editorInsertNewLine();
+				break;
+			}
+
+		case CTRL_KEY('q'):
+			{
+				if (editor.dirty && quit_times > 0)
+				{
+					editorSetStatusMessage("WARNING!!! File has unsaved changes. "\
+						"Press Ctrl-Q %d more times to quit.", quit_times);
+					quit_times--;
+					return;
+				}
+
+				write(STDOUT_FILENO, "\x1b[2J", 4);
+				write(STDOUT_FILENO, "\x1b[H", 3);
+				exit(0);
+				break;
+			}
+
+		case CTRL_KEY('s'):
+			{
+				editorSave();
+				break;
+			}
+
+		case HOME_KEY:
+			{
+				editor.cx = 0;
+				break;
+			}
+
+		case END_KEY:
+			{
+				if (editor.cy < editor.numrows)
+				{
+					editor.cx = editorRowAt(editor.cy)->size;
+				}
+
+				break;
+			}
+
+		case CTRL_KEY('f'):
+			{
+				editorFind();
+				break;
+			}
+
+		case CTRL_KEY('e'):
+			{
+				editorReplace();
+				break;
+			}
+
+		case CTRL_KEY('z'):
+			{
+				editorUndo();
+				break;
+			}
+
+		case CTRL_KEY('y'):
+			{
+				editorRedo();
+				break;
+			}
+
+		case CTRL_KEY('p'):
+			{
+				editorShowStats();
+				break;
+			}
+
+		case BACKSPACE:
+		case CTRL_KEY('h'):
+		case DEL_KEY:
+			{
+				if (ch == DEL_KEY)
+				{
+					editorMoveCursor(ARROW_RIGHT);
+				}
+
+				editorDelChar();
+				break;
+			}
+
+		case PAGE_UP:
+		case PAGE_DOWN:
+			{
+				if (ch == PAGE_UP)
+				{
+					editor.cy = editor.rowoff;
+				}
+				else if (ch == PAGE_DOWN)
+				{
+					editor.cy = editor.rowoff + editor.screenrows - 1;
+					if (editor.cy > editor.numrows)
+					{
+						editor.cy = editor.numrows;
+					}
+				}
+
+				times = editor.screenrows;
+				while (times-- != 0)
+				{
+					editorMoveCursor(ch == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+				}
+
+				break;
+			}
+
+		case ARROW_UP:
+		case ARROW_DOWN:
+		case ARROW_LEFT:
+		case ARROW_RIGHT:
+			{
+				editorMoveCursor(ch);
+				break;
+			}
+
+		case CTRL_KEY('l'):
+			{
+				// repaint everything in case the terminal got out of step
+				editor.frame.valid = false;
+				break;
+			}
+
+		case PASTE_START:
+			{
+				editorPaste();
+				break;
+			}
+
+		case '\x1b':
+		case PASTE_END:
+			{
+				break;
+			}
+
+		default:
+			{
+				editorInsertChar(ch);
+				break;
+			}
+	}
+
+	quit_times = QUIT_TIMES;
+}
+
+/**
+ *	editorProcessInput
+ *
+ *	@param none
+ *
+ *	Wait for a key, then keep applying keys until the next frame is due.
+ *	Keys that are already waiting are always applied first, so frames are
+ *	skipped while input is pending and the frame drawn afterwards shows
+ *	the final state. Time spent waiting is left out of the input time.
+ */
+void editorProcessInput(void)
+{
+	struct editorStats *st = &editor.stats;
+	unsigned long keys = st->keys;
+	double start = editorClock(), wait = st->wait, waited;
+	int timeout, nread;
+
+	editorProcessKeypress();
+	while (true)
+	{
+		while (editorInputPending())
+		{
+			editorProcessKeypress();
+		}
+
+		timeout = (st->frame_at + FRAME_INTERVAL - editorClock()) * 1000;
+		if (timeout <= 0)
+		{
+			break;
+		}
+
+		waited = editorClock();
+		editorUnlock();
+		nread = editorInputFill(timeout);
+		editorLock();
+		st->wait += editorClock() - waited;
+
+		if (nread == 0)
+		{
+			break;
+		}
+	}
+
+	st->frame_input = editorClock() - start - (st->wait - wait);
+	st->frame_keys = st->keys - keys;
+}
+
+/**
+ *	editorDrawRows
+ *
+ *	@param none
+ *
+ *	Compose the text area into the frame
+ */
+void editorDrawRows(void)
+{
+	int y, len, j, match = -1;
+	unsigned char *ch, *hl;
+	int filerow;
+	bool plain;
+	erow *row;
+
+	editorIndexRows(editor.rowoff + editor.screenrows);
+	if (editor.search.valid)
+	{
+		match = editorSearchFirst(editor.rowoff, 0);
+	}
+
+	for (y = 0; y < editor.screenrows; y++)
+	{
+		filerow = y + editor.rowoff;
+		if (filerow >= editor.numrows)
+		{
+			if (editor.numrows == 0 && y == editor.screenrows / 3)
+			{
+				char welcome[80];
+				int welcomelen = snprintf(welcome, sizeof(welcome),
+					"Kilo editor -- version %s", KILO_VERSION);
+				if (welcomelen > editor.screencols) welcomelen = editor.screencols;
+				int padding = (editor.screencols - welcomelen) / 2;
+				if (padding)
+				{
+					editorFramePut(y, 0, "~", 1, HL_NORMAL);
+				}
+
+				editorFramePut(y, padding, welcome, welcomelen, HL_NORMAL);
+			}
+			else
+			{
+				editorFramePut(y, 0, "~", 1, HL_NORMAL);
+			}
+		}
+		else
+		{
+			row = editorRowAt(filerow);
+			plain = !editorRowEnsure(row, true);
+			len = row->rsize - editor.coloff;
+			if (len < 0)
+			{
+				len = 0;
+			}
+
+			if (len > editor.screencols)
+			{
+				len = editor.screencols;
+			}
+
+			ch = &editor.frame.next.ch[y * editor.frame.cols];
+			hl = &editor.frame.next.attr[y * editor.frame.cols];
+			memcpy(ch, &row->render[editor.coloff], len);
+			if (plain)
+			{
+				// not highlighted yet, the worker will get to it
+				memset(hl, HL_NORMAL, len);
+				if (editor.hl_plain_first == -1)
+				{
+					editor.hl_plain_first = filerow;
+				}
+
+				editor.hl_plain_last = filerow;
+			}
+			else
+			{
+				memcpy(hl, &row->hl[editor.coloff], len);
+			}
+
+			// control characters show as an inverted letter
+			for (j = 0; j < len; j++)
+			{
+				if (ch[j] < 32 || ch[j] == 127)
+				{
+					ch[j] = (ch[j] <= 26) ? '@' + ch[j] : '?';
+					hl[j] = CELL_INVERSE;
+				}
+			}
+
+			if (match != -1)
+			{
+				editorDrawMatches(row, filerow, hl, len, &match);
+			}
+		}
+	}
+}
+
+/**
+ *	editorDrawMatches
+ *
+ *	@param row editor row
+ *	@param at index of the row
+ *	@param hl the row's cells in the frame
+ *	@param len number of cells drawn
+ *	@param next first match not on an earlier row, moved past this row
+ *
+ *	Lay the search matches over a row as it is copied into the frame,
+ *	the current one inverted. The row's own highlight is never touched,
+ *	and only rows on screen are looked at.
+ */
+void editorDrawMatches(erow *row, int at, unsigned char *hl, int len, int *next)
+{
+	struct search *s = &editor.search;
+	struct match *m;
+	int k = 0, j = 0, ek, ej, cx = 0, rx = 0, from, to;
+
+	for (; *next < s->set.n && s->set.m[*next].row == at; (*next)++)
+	{
+		m = &s->set.m[*next];
+		if (rx >= editor.coloff + len)
+		{
+			continue;
+		}
+
+		rx = editorRowCxStep(row, &k, &j, rx, m->cx - cx);
+		cx = m->cx;
+		ek = k;
+		ej = j;
+		from = rx - editor.coloff;
+		to = editorRowCxStep(row, &ek, &ej, rx, m->len) - editor.coloff;
+		from = (from < 0) ? 0 : from;
+		to = (to > len) ? len : to;
+		if (from < to)
+		{
+			memset(&hl[from], (*next == s->current) ? (HL_MATCH | CELL_INVERSE) : HL_MATCH, to - from);
+		}
+	}
+}
+
+/**
+ *	editorScroll
+ *
+ *	@param none
+ *
+ */
+void editorScroll(void)
+{
+	editor.rx = 0;
+	if (editor.cy < editor.numrows)
+	{
+		editor.rx = editorRowCxToRx(editorRowAt(editor.cy), editor.cx);
+	}
+
+	if (editor.cy < editor.rowoff)
+	{
+		editor.rowoff = editor.cy;
+	}
+
+	if (editor.cy >= editor.rowoff + editor.screenrows)
+	{
+		editor.rowoff = editor.cy - editor.screenrows + 1;
+	}
+
+	if (editor.rx < editor.coloff)
+	{
+		editor.coloff = editor.rx;
+	}
+
+	if (editor.rx >= editor.coloff + editor.screencols)
+	{
+		editor.coloff = editor.rx - editor.screencols + 1;
+	}
+}
+
+/**
+ *	editorRefreshScreen
+ *
+ *	@param none
+ *
+ *	compose the next frame and send only what differs from the last one
+ */
+void editorRefreshScreen(void)
+{
+	struct abuf *ab = &editor.out;
+	unsigned long allocs = editor.stats.allocs;
+	double start = editorClock();
+	char buf[32];
+
+	abReset(ab);
+	editorScroll();
+	editorCacheTrim();
+	editorHlCollect();
+	editor.hl_budget = editor.hlw.running ? HL_INLINE_ROWS : HL_FRAME_ROWS;
+	editor.hl_behind = false;
+	editor.hl_plain_first = -1;
+	editor.hl_plain_last = -1;
+
+	editorFrameBegin();
+	editorDrawRows();
+	editorDrawStatusBar();
+	editorDrawMessageBar();
+
+	abAppend(ab, "\x1b[?25l", 6);
+	editorFrameFlush(ab);
+
+	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (editor.cy - editor.rowoff) + 1, (editor.rx - editor.coloff) + 1);
+	abAppend(ab, buf, strlen(buf));
+
+	abAppend(ab, "\x1b[?25h", 6);
+
+	write(STDOUT_FILENO, ab->b, ab->len);
+
+	editor.stats.frames++;
+	editor.stats.frame_allocs = editor.stats.allocs - allocs;
+	editor.stats.frame_bytes = ab->len;
+	editor.stats.frame_at = editorClock();
+	editor.stats.frame_render = editor.stats.frame_at - start;
+
+	editorHlSchedule();
+}
+
+/**
+ *	editorFrameBegin
+ *
+ *	@param none
+ *
+ *	Size the frame to the window and blank the frame being composed. A
+ *	size change means the terminal contents are unknown.
+ */
+void editorFrameBegin(void)
+{
+	struct frame *f = &editor.frame;
+	int rows = editor.screenrows + 2, cols = editor.screencols;
+
+	if (rows != f->rows || cols != f->cols)
+	{
+		free(f->shown.ch);
+		free(f->shown.attr);
+		free(f->next.ch);
+		free(f->next.attr);
+		f->shown.ch = malloc(rows * cols);
+		f->shown.attr = malloc(rows * cols);
+		f->next.ch = malloc(rows * cols);
+		f->next.attr = malloc(rows * cols);
+		if (f->shown.ch == NULL || f->shown.attr == NULL || f->next.ch == NULL || f->next.attr == NULL)
+		{
+			die("malloc");
+		}
+
+		f->rows = rows;
+		f->cols = cols;
+		f->valid = false;
+		editor.stats.allocs += 4;
+	}
+
+	memset(f->next.ch, ' ', rows * cols);
+	memset(f->next.attr, HL_NORMAL, rows * cols);
+}
+
+/**
+ *	editorFramePut
+ *
+ *	@param y screen row
+ *	@param x screen column
+ *	@param s glyphs
+ *	@param len number of glyphs
+ *	@param attr highlight class, optionally with CELL_INVERSE
+ *
+ */
+void editorFramePut(int y, int x, const char *s, int len, unsigned char attr)
+{
+	int at = y * editor.frame.cols + x;
+
+	if (x + len > editor.frame.cols)
+	{
+		len = editor.frame.cols - x;
+	}
+
+	memcpy(&editor.frame.next.ch[at], s, len);
+	memset(&editor.frame.next.attr[at], attr, len);
+}
+
+/**
+ *	editorBuildSgrTable
+ *
+ *	@param none
+ *
+ *	Precompute the escape sequence that switches to each cell attribute
+ */
+void editorBuildSgrTable(void)
+{
+	int attr, color;
+
+	for (attr = 0; attr < 256; attr++)
+	{
+		color = 39;
+		if ((attr & ~CELL_INVERSE) != HL_NORMAL)
+		{
+			color = editorSyntaxToColor(attr & ~CELL_INVERSE);
+		}
+
+		editor.sgr[attr].len = snprintf(editor.sgr[attr].seq, sizeof(editor.sgr[attr].seq), \
+			"\x1b[%d;%dm", (attr & CELL_INVERSE) ? 7 : 27, color);
+	}
+}
+
+/**
+ *	editorFrameEmit
+ *
+ *	@param ab buffer
+ *	@param ch glyphs of the span
+ *	@param attr attributes of the span
+ *	@param len span length
+ *	@param cur attribute the terminal is currently using, updated
+ *
+ *	Send a span as runs of equal attribute: one escape sequence and one
+ *	copy per run
+ */
+void editorFrameEmit(struct abuf *ab, const unsigned char *ch, const unsigned char *attr, int len, unsigned char *cur)
+{
+	int j = 0, k;
+
+	while (j < len)
+	{
+		k = j + 1;
+		while (k < len && attr[k] == attr[j])
+		{
+			k++;
+		}
+
+		if (attr[j] != *cur)
+		{
+			*cur = attr[j];
+			abAppend(ab, editor.sgr[*cur].seq, editor.sgr[*cur].len);
+		}
+
+		abAppend(ab, (const char *) &ch[j], k - j);
+		j = k;
+	}
+}
+
+/**
+ *	editorFrameScroll
+ *
+ *	@param ab buffer
+ *
+ *	When the view moved up or down by less than a screen, have the terminal
+ *	scroll the text area itself and shift the shown cells to match, so the
+ *	diff only has to draw the rows that scrolled into view.
+ */
+void editorFrameScroll(struct abuf *ab)
+{
+	struct frame *f = &editor.frame;
+	int text = f->rows - 2, delta = editor.rowoff - f->rowoff;
+	int n = abs(delta), keep = text - n;
+	char buf[48];
+
+	if (delta == 0 || n >= text || editor.coloff != f->coloff)
+	{
+		return;
+	}
+
+	// the region covers only the text rows so the bars stay put
+	snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", text, n, (delta > 0) ? 'S' : 'T');
+	abAppend(ab, buf, strlen(buf));
+
+	if (delta > 0)
+	{
+		memmove(f->shown.ch, &f->shown.ch[n * f->cols], keep * f->cols);
+		memmove(f->shown.attr, &f->shown.attr[n * f->cols], keep * f->cols);
+		memset(&f->shown.ch[keep * f->cols], ' ', n * f->cols);
+		memset(&f->shown.attr[keep * f->cols], HL_NORMAL, n * f->cols);
+	}
+	else
+	{
+		memmove(&f->shown.ch[n * f->cols], f->shown.ch, keep * f->cols);
+		memmove(&f->shown.attr[n * f->cols], f->shown.attr, keep * f->cols);
+		memset(f->shown.ch, ' ', n * f->cols);
+		memset(f->shown.attr, HL_NORMAL, n * f->cols);
+	}
+}
+
+/**
+ *	editorFrameFlush
+ *
+ *	@param ab buffer
+ *
+ *	Emit the cells that differ from what the terminal already shows. Runs
+ *	of changed cells separated by short unchanged gaps are sent as one
+ *	span, and a span reaching blank cells at the end of a row becomes an
+ *	erase to end of line. Rows holding non-ASCII bytes are redrawn whole
+ *	since their byte offsets don't match terminal columns.
+ */
+void editorFrameFlush(struct abuf *ab)
+{
+	struct frame *f = &editor.frame;
+	unsigned char *och, *oattr, *nch, *nattr;
+	unsigned char attr = HL_NORMAL;
+	int y, x, j, start, end, gap, blankfrom;
+	bool wide, erase, full = !f->valid;
+	char buf[32];
+
+	if (full)
+	{
+		abAppend(ab, "\x1b[m\x1b[2J", 7);
+		memset(f->shown.ch, ' ', f->rows * f->cols);
+		memset(f->shown.attr, HL_NORMAL, f->rows * f->cols);
+		f->valid = true;
+	}
+	else
+	{
+		editorFrameScroll(ab);
+	}
+
+	f->rowoff = editor.rowoff;
+	f->coloff = editor.coloff;
+
+	for (y = 0; y < f->rows; y++)
+	{
+		och = &f->shown.ch[y * f->cols];
+		oattr = &f->shown.attr[y * f->cols];
+		nch = &f->next.ch[y * f->cols];
+		nattr = &f->next.attr[y * f->cols];
+		if (memcmp(och, nch, f->cols) == 0 && memcmp(oattr, nattr, f->cols) == 0)
+		{
+			continue;
+		}
+
+		wide = false;
+		for (x = 0; x < f->cols; x++)
+		{
+			wide |= ((och[x] | nch[x]) >= 0x80);
+		}
+
+		blankfrom = f->cols;
+		while (blankfrom > 0 && nch[blankfrom - 1] == ' ' && nattr[blankfrom - 1] == HL_NORMAL)
+		{
+			blankfrom--;
+		}
+
+		x = 0;
+		while (x < f->cols)
+		{
+			if (!wide && och[x] == nch[x] && oattr[x] == nattr[x])
+			{
+				x++;
+				continue;
+			}
+
+			// after a clear the rest of the row goes out as one span
+			start = x;
+			end = f->cols;
+			if (!wide && !full)
+			{
+				gap = 0;
+				for (j = x; j < f->cols && gap <= FRAME_SPAN_GAP; j++)
+				{
+					if (och[j] != nch[j] || oattr[j] != nattr[j])
+					{
+						end = j + 1;
+						gap = 0;
+					}
+					else
+					{
+						gap++;
+					}
+				}
+			}
+
+			snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, start + 1);
+			abAppend(ab, buf, strlen(buf));
+
+			erase = (end > blankfrom);
+			if (erase)
+			{
+				end = (start > blankfrom) ? start : blankfrom;
+			}
+
+			editorFrameEmit(ab, &nch[start], &nattr[start], end - start, &attr);
+
+			if (erase)
+			{
+				if (attr != HL_NORMAL)
+				{
+					attr = HL_NORMAL;
+					abAppend(ab, "\x1b[m", 3);
+				}
+
+				abAppend(ab, "\x1b[K", 3);
+				break;
+			}
+
+			x = end;
+		}
+
+		memcpy(och, nch, f->cols);
+		memcpy(oattr, nattr, f->cols);
+	}
+
+	if (attr != HL_NORMAL)
+	{
+		abAppend(ab, "\x1b[m", 3);
+	}
+}
+
+/**
+ *	abReserve
+ *
+ *	@param ab buffer
+ *	@param len number of bytes about to be written
+ *
+ *	Make room for len bytes and return where they go. Capacity grows
+ *	geometrically and is kept across abReset, so a buffer reused for every
+ *	frame stops allocating once it has seen the largest frame.
+ */
+char *abReserve(struct abuf *ab, int len)
+{
+	char *new;
+	int cap;
+
+	if (ab->len + len > ab->cap)
+	{
+		cap = (ab->cap != 0) ? ab->cap : 4096;
+		while (cap < ab->len + len)
+		{
+			cap *= 2;
+		}
+
+		new = realloc(ab->b, cap);
+		if (new == NULL)
+		{
+			die("realloc");
+		}
+
+		ab->b = new;
+		ab->cap = cap;
+		editor.stats.allocs++;
+	}
+
+	return &ab->b[ab->len];
+}
+
+/**
+ *	abAppend
+ *
+ *	@param ab buffer
+ *	@param s string
+ *	@param len length of string
+ * 
+ *	append string to buffer
+ */
+void abAppend(struct abuf *ab, const char *s, int len)
+{
+	memcpy(abReserve(ab, len), s, len);
+	ab->len += len;
+}
+
+/**
+ *	abAppendByte
+ *
+ *	@param ab buffer
+ *	@param c byte
+ *
+ */
+void abAppendByte(struct abuf *ab, char c)
+{
+	if (ab->len == ab->cap)
+	{
+		abReserve(ab, 1);
+	}
+
+	ab->b[ab->len++] = c;
+}
+
+/**
+ *	abReset
+ *
+ *	@param ab buffer
+ *
+ *	Empty the buffer but keep its memory for the next frame
+ */
+void abReset(struct abuf *ab)
+{
+	ab->len = 0;
+}
+
+/**
+ *	abFree
+ *
+ *	@param ab buffer
+ *
+ *	free buffer string
+ */
+void abFree(struct abuf *ab)
+{
+	free(ab->b);
+	ab->b = NULL;
+	ab->len = 0;
+	ab->cap = 0;
+}
+
+/**
+ *	getCursorPosition
+ *
+ *	@param none
+ *
+ */
+int getCursorPosition(int *rows, int *cols)
+{
+	struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+	char buf[32];
+	unsigned int i = 0;
+
+	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
+	{
+		return -1;
+	}
+
+	while (i < sizeof(buf) - 1)
+	{
+		if (poll(&pfd, 1, INPUT_WAIT_MS) <= 0 || read(STDIN_FILENO, &buf[i], 1) != 1)
+		{
+			break;
+		}
+
+		if (buf[i] == 'R')
+		{
+			break;
+		}
+
+		i++;
+	}
+
+	buf[i] = '\0';
+
+	if (buf[0] != '\x1b' || buf[1] != '[')
+	{
+		return -1;
+	}
+
+	if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ *	is_separator
+ *
+ *	@param ch character
+ *
+ */
+bool is_separator(int ch)
+{
+	return separators[(unsigned char) ch];
+}
+
+/**
+ *	editorUpdateSyntax
+ *
+ *	@param row editor row
+ *
+ *	Lex a row starting from the state the previous row ends in
+ */
+void editorUpdateSyntax(erow *row)
+{
+	if (row->hl == NULL)
+	{
+		editor.stats.allocs++;
+	}
+
+	row->hl = realloc(row->hl, row->rsize + 1);
+	editorLexStateIn(&row->hl_in, editorRowPrev(row));
+	row->hl_gen = editor.hl_gen;
+	row->hl_seq = 0;
+	row->flags &= ~ROW_DIRTY;
+
+	editorLexRow(editor.syntax, row->render, row->rsize, row->hl, &row->hl_in, &row->hl_out);
+}
+
+/**
+ *	editorLexRow
+ *
+ *	@param syntax syntax to lex with, may be NULL
+ *	@param render rendered row, NUL terminated
+ *	@param rsize length of render
+ *	@param hl set to the highlight class of each byte
+ *	@param in state the row starts in
+ *	@param out set to the state the row ends in
+ *
+ *	Touches nothing but its arguments, so the highlight worker can use it.
+ *	Each byte is looked up in the syntax's class table, so only bytes that
+ *	can start something are compared against delimiters, and runs of plain
+ *	identifier bytes, comments and strings are skipped without a look at
+ *	the bytes in between.
+ */
+void editorLexRow(struct editorSyntax *syntax, const char *render, int rsize, unsigned char *hl, \
+	const struct lexstate *in, struct lexstate *out)
+{
+	const struct lexer *lx;
+	int i = 0, j, keyword_len;
+	int in_comment, in_string;
+	bool prev_separator = true, continued = false;
+	unsigned char c, ch, keyword_class;
+
+	memset(hl, HL_NORMAL, rsize);
+
+	if (syntax == NULL)
+	{
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+
+	lx = syntax->lexer;
+	in_comment = in->comment;
+	in_string = in->string;
+
+	while (i < rsize)
+	{
+		if (in_comment != 0 && lx->comments && in_string == 0)
+		{
+			// only the first byte of the end, or of a nested start, can change anything
+			j = i + editorLexScan(&render[i], rsize - i, lx->close[0], lx->close[1]);
+			memset(&hl[i], HL_MULTI_COMMENT, j - i);
+			i = j;
+			if (i == rsize)
+			{
+				break;
+			}
+
+			if (editorLexAt(render, rsize, i, syntax->multi_comment_end, lx->mce_len))
+			{
+				memset(&hl[i], HL_MULTI_COMMENT, lx->mce_len);
+				i += lx->mce_len;
+				in_comment--;
+				prev_separator = true;
+			}
+			else if (lx->nested && in_comment < UCHAR_MAX && \
+				editorLexAt(render, rsize, i, syntax->multi_comment_start, lx->mcs_len))
+			{
+				memset(&hl[i], HL_MULTI_COMMENT, lx->mcs_len);
+				i += lx->mcs_len;
+				in_comment++;
+			}
+			else
+			{
+				hl[i++] = HL_MULTI_COMMENT;
+			}
+
+			continue;
+		}
+
+		if (in_string != 0 && (syntax->flags & HIGHLIGHT_STRINGS))
+		{
+			j = i + editorLexScan(&render[i], rsize - i, in_string, '\\');
+			if (j > i)
+			{
+				memset(&hl[i], HL_STRING, j - i);
+				prev_separator = true;
+				continued = false;
+				i = j;
+			}
+
+			if (i == rsize)
+			{
+				break;
+			}
+
+			hl[i] = HL_STRING;
+			if (render[i] == '\\')
+			{
+				if (i + 1 < rsize)
+				{
+					hl[i + 1] = HL_STRING;
+					i += 2;
+					continue;
+				}
+
+				// a backslash at the end of the row continues the string
+				continued = true;
+			}
+			else
+			{
+				continued = false;
+				in_string = 0;
+			}
+
+			prev_separator = true;
+			i++;
+			continue;
+		}
+
+		ch = render[i];
+		c = lx->cls[ch];
+
+		if (c & LEX_OPEN)
+		{
+			if (in_comment == 0 && in_string == 0 && \
+				editorLexAt(render, rsize, i, syntax->singleline_comment_start, lx->scs_len))
+			{
+				memset(&hl[i], HL_COMMENT, rsize - i);
+				break;
+			}
+
+			if (lx->comments && in_string == 0)
+			{
+				if (editorLexAt(render, rsize, i, syntax->multi_comment_start, lx->mcs_len))
+				{
+					memset(&hl[i], HL_MULTI_COMMENT, lx->mcs_len);
+					i += lx->mcs_len;
+					in_comment = 1;
+					continue;
+				}
+				else if (editorLexAt(render, rsize, i, syntax->multi_comment_start2, lx->mcs2_len))
+				{
+					memset(&hl[i], HL_MULTI_COMMENT, lx->mcs2_len);
+					i += lx->mcs2_len;
+					in_comment = 1;
+					continue;
+				}
+			}
+		}
+
+		if (c & LEX_QUOTE)
+		{
+			in_string = ch;
+			hl[i++] = HL_STRING;
+			continue;
+		}
+
+		if ((c & (LEX_DIGIT | LEX_DOT)) && \
+			((i > 0 && hl[i - 1] == HL_NUMBER) || (prev_separator && (c & LEX_DIGIT))))
+		{
+			hl[i++] = HL_NUMBER;
+			prev_separator = false;
+			continue;
+		}
+
+		if (prev_separator && (c & LEX_KEYWORD))
+		{
+			keyword_len = editorTrieMatch(syntax->trie, &render[i], &keyword_class);
+			if (keyword_len > 0)
+			{
+				memset(&hl[i], keyword_class, keyword_len);
+				i += keyword_len;
+				prev_separator = false;
+				continue;
+			}
+		}
+
+		prev_separator = (c & LEX_SEPARATOR) != 0;
+		i++;
+
+		// the rest of an identifier, or of a run of blanks, can't start anything
+		if (!prev_separator)
+		{
+			while (i < rsize && (lx->cls[(unsigned char) render[i]] & LEX_STOP) == 0)
+			{
+				i++;
+			}
+		}
+		else
+		{
+			while (i < rsize && lx->cls[(unsigned char) render[i]] == LEX_SEPARATOR)
+			{
+				i++;
+			}
+		}
+	}
+
+	out->comment = in_comment;
+	out->string = continued ? in_string : 0;
+}
+
+/**
+ *	editorLexRowBytewise
+ *
+ *	@param syntax syntax to lex with, may be NULL
+ *	@param render rendered row, NUL terminated
+ *	@param rsize length of render
+ *	@param hl set to the highlight class of each byte
+ *	@param in state the row starts in
+ *	@param out set to the state the row ends in
+ *
+ *	Reference lexer that tries every rule at every byte. Only the
+ *	benchmark uses it, to time editorLexRow against and check its output.
+ */
+void editorLexRowBytewise(struct editorSyntax *syntax, const char *render, int rsize, unsigned char *hl, \
+	const struct lexstate *in, struct lexstate *out)
+{
+	int i = 0;
+	bool prev_separator = true, continued = false;
+	int in_comment = 0, in_string = 0;
+	int scs_len = 0, mce_len = 0, mcs_len = 0, mcs2_len = 0;
+	int keyword_len;
+	unsigned char prev_hl, keyword_class;
+	char ch;
+	char *scs, *mcs, *mcs2, *mce;
+
+	memset(hl, HL_NORMAL, rsize);
+
+	if (syntax == NULL)
+	{
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+	else
+	{
+		scs = syntax->singleline_comment_start;
+		mcs = syntax->multi_comment_start;
+		mcs2 = syntax->multi_comment_start2;
+		mce = syntax->multi_comment_end;
+
+		if (scs != NULL)
+		{
+			scs_len = strlen(scs);
+		}
+
+		if (mcs != NULL)
+		{
+			mcs_len = strlen(mcs);
+		}
+
+		if (mcs2 != NULL)
+		{
+			mcs2_len = strlen(mcs2);
+		}
+
+		if (mce != NULL)
+		{
+			mce_len = strlen(mce);
+		}
+
+		in_comment = in->comment;
+		in_string = in->string;
+
+		while (i < rsize)
+		{
+			ch = render[i];
+
+			if (i > 0)
+			{
+				prev_hl = hl[i - 1];
+			}
+			else
+			{
+				prev_hl = HL_NORMAL;
+			}
+
+			if ((scs_len != 0) && !in_string && !in_comment)
+			{
+				if (!strncmp(&render[i], scs, scs_len))
+				{
+					memset(&hl[i], HL_COMMENT, rsize - i);
+					break;
+				}
+			}
+
+			if ((mcs2_len || mcs_len) && mce_len && (in_string == false))
+			{
+				if (in_comment != 0)
+				{
+					hl[i] = HL_MULTI_COMMENT;
+					if (strncmp(&render[i], mce, mce_len) == 0)
+					{
+						memset(&hl[i], HL_MULTI_COMMENT, mce_len);
+						i += mce_len;
+						in_comment--;
+						prev_separator = true;
+						continue;
+					}
+					else if ((syntax->flags & HIGHLIGHT_NESTED_COMMENTS) && in_comment < UCHAR_MAX && \
+						strncmp(&render[i], mcs, mcs_len) == 0)
+					{
+						memset(&hl[i], HL_MULTI_COMMENT, mcs_len);
+						i += mcs_len;
+						in_comment++;
+						continue;
+					}
+					else
+					{
+						i++;
+						continue;
+					}
+				}
+				else if (strncmp(&render[i], mcs, mcs_len) == 0)
+				{
+					memset(&hl[i], HL_MULTI_COMMENT, mcs_len);
+					i += mcs_len;
+					in_comment = 1;
+					continue;
+				}
+				else if (strncmp(&render[i], mcs2, mcs2_len) == 0)
+				{
+					memset(&hl[i], HL_MULTI_COMMENT, mcs2_len);
+					i += mcs2_len;
+					in_comment = 1;
+					continue;
+				}
+			}
+
+			if (syntax->flags &HIGHLIGHT_STRINGS)
+			{
+				if (in_string != 0)
+				{
+					hl[i] = HL_STRING;
+					if (ch == '\\' && i + 1 < rsize)
+					{
+						hl[i + 1] = HL_STRING;
+						i += 2;
+						continue;
+					}
+
+					// a backslash at the end of the row continues the string
+					continued = (ch == '\\');
+
+					if (ch == in_string)
+					{
+						in_string = 0;
+					}
+
+					i++;
+					prev_separator = true;
+					continue;
+				}
+				else
 				{
-					if (current_color != -1)
+					if (ch == '"' || ch == '\'')
 					{
-						abAppend(ab, "\x1b[39m", 5);
-						current_color = -1;
+						in_string = ch;
+						hl[i] = HL_STRING;
+						i++;
+						continue;
 					}
+				}
+			}
+
+			if (syntax->flags &HIGHLIGHT_NUMBERS)
+			{
+				if ((isdigit(ch) && (prev_separator || prev_hl == HL_NUMBER)) ||
+					(ch == '.' && prev_hl == HL_NUMBER))
+				{
+					hl[i] = HL_NUMBER;
+					i++;
+					prev_separator = false;
+					continue;
+				}
+			}
+
+			if (prev_separator != 0)
+			{
+				keyword_len = editorTrieMatch(syntax->trie, &render[i], &keyword_class);
+				if (keyword_len > 0)
+				{
+					memset(&hl[i], keyword_class, keyword_len);
+					i += keyword_len;
+					prev_separator = false;
+					continue;
+				}
+			}
+
+			prev_separator = is_separator(ch);
+			i++;
+		}
+
+		out->comment = in_comment;
+		out->string = continued ? in_string : 0;
+	}
+}
+
+/**
+ *	editorLexerCompile
+ *
+ *	@param syntax syntax whose trie is already compiled
+ *
+ *	Classify every byte by what it can start in plain text, and note the
+ *	bytes that can end or nest a comment, for editorLexRow
+ */
+struct lexer *editorLexerCompile(struct editorSyntax *syntax)
+{
+	struct lexer *lx = calloc(1, sizeof(struct lexer));
+	const struct kwtrie *t = syntax->trie;
+	int c;
+
+	if (lx == NULL)
+	{
+		die("calloc");
+	}
+
+	lx->scs_len = syntax->singleline_comment_start ? strlen(syntax->singleline_comment_start) : 0;
+	lx->mcs_len = syntax->multi_comment_start ? strlen(syntax->multi_comment_start) : 0;
+	lx->mcs2_len = syntax->multi_comment_start2 ? strlen(syntax->multi_comment_start2) : 0;
+	lx->mce_len = syntax->multi_comment_end ? strlen(syntax->multi_comment_end) : 0;
+	lx->comments = (lx->mcs_len || lx->mcs2_len) && lx->mce_len;
+	lx->nested = (syntax->flags & HIGHLIGHT_NESTED_COMMENTS) && lx->mcs_len;
+
+	for (c = 0; c < 256; c++)
+	{
+		if (separators[c])
+		{
+			lx->cls[c] |= LEX_SEPARATOR;
+		}
+
+		if ((syntax->flags & HIGHLIGHT_NUMBERS) && (isdigit(c) || c == '.'))
+		{
+			lx->cls[c] |= isdigit(c) ? LEX_DIGIT : LEX_DOT;
+		}
+
+		if ((syntax->flags & HIGHLIGHT_STRINGS) && (c == '"' || c == '\''))
+		{
+			lx->cls[c] |= LEX_QUOTE;
+		}
+
+		if (t->cls[c] != 0 && t->trans[t->cls[c]] != 0)
+		{
+			lx->cls[c] |= LEX_KEYWORD;
+		}
+	}
+
+	if (lx->scs_len)
+	{
+		lx->cls[(unsigned char) syntax->singleline_comment_start[0]] |= LEX_OPEN;
+	}
+
+	if (lx->comments)
+	{
+		if (lx->mcs_len)
+		{
+			lx->cls[(unsigned char) syntax->multi_comment_start[0]] |= LEX_OPEN;
+		}
+
+		if (lx->mcs2_len)
+		{
+			lx->cls[(unsigned char) syntax->multi_comment_start2[0]] |= LEX_OPEN;
+		}
+
+		lx->close[0] = syntax->multi_comment_end[0];
+		lx->close[1] = lx->nested ? syntax->multi_comment_start[0] : lx->close[0];
+	}
+
+	return lx;
+}
+
+/**
+ *	editorLexScan
+ *
+ *	@param s text to scan
+ *	@param len number of bytes
+ *	@param a byte to look for
+ *	@param b another byte to look for
+ *
+ *	Offset of the first a or b in s, or len if there is none. Compares
+ *	16 bytes at a time where SSE2 is available.
+ */
+int editorLexScan(const char *s, int len, char a, char b)
+{
+	int i = 0;
+#ifdef __SSE2__
+	__m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), v;
+	int mask;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *) &s[i]);
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+		if (mask != 0)
+		{
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+
+	for (; i < len; i++)
+	{
+		if (s[i] == a || s[i] == b)
+		{
+			return i;
+		}
+	}
+
+	return len;
+}
+
+/**
+ *	editorLexAt
+ *
+ *	@param render rendered row
+ *	@param rsize length of render
+ *	@param at offset into render
+ *	@param delim delimiter to compare with
+ *	@param len length of delim, 0 if the syntax has none
+ *
+ */
+bool editorLexAt(const char *render, int rsize, int at, const char *delim, int len)
+{
+	return len > 0 && at + len <= rsize && memcmp(&render[at], delim, len) == 0;
+}
+
+/**
+ *	editorTrieCompile
+ *
+ *	@param keywords NULL terminated list, a trailing | marks a type keyword
+ *
+ *	Build a trie over the keywords. Bytes that occur in keywords are mapped
+ *	to small classes so each node is a short row of transitions; node 0 is
+ *	the root, so 0 also means no transition. The arrays are flat so the
+ *	trie can be written out and mapped back in as is.
+ */
+struct kwtrie *editorTrieCompile(char **keywords)
+{
+	struct kwtrie *t = calloc(1, sizeof(struct kwtrie));
+	int i, j, len, node, c, maxnodes = 1, nclasses = 0;
+
+	if (t == NULL)
+	{
+		die("calloc");
+	}
+
+	for (i = 0; keywords[i]; i++)
+	{
+		len = strlen(keywords[i]);
+		maxnodes += len;
+		for (j = 0; j < len; j++)
+		{
+			c = (unsigned char) keywords[i][j];
+			if (t->cls[c] == 0 && !(c == '|' && j == len - 1))
+			{
+				t->cls[c] = ++nclasses;
+			}
+		}
+	}
+
+	t->width = nclasses + 1;
+	t->nnodes = 1;
+	t->trans = calloc((size_t) maxnodes * t->width, sizeof(int));
+	t->accept = calloc(maxnodes, 1);
+	if (t->trans == NULL || t->accept == NULL)
+	{
+		die("calloc");
+	}
+
+	for (i = 0; keywords[i]; i++)
+	{
+		len = strlen(keywords[i]);
+		if (len > 0 && keywords[i][len - 1] == '|')
+		{
+			len--;
+		}
+
+		if (len == 0)
+		{
+			continue;
+		}
+
+		node = 0;
+		for (j = 0; j < len; j++)
+		{
+			c = t->cls[(unsigned char) keywords[i][j]];
+			if (t->trans[node * t->width + c] == 0)
+			{
+				t->trans[node * t->width + c] = t->nnodes++;
+			}
+
+			node = t->trans[node * t->width + c];
+		}
+
+		// the first of duplicate keywords wins, as in the list
+		if (t->accept[node] == 0)
+		{
+			t->accept[node] = (len < (int) strlen(keywords[i])) ? HL_KEYWORD2 : HL_KEYWORD1;
+		}
+	}
+
+	return t;
+}
+
+/**
+ *	editorTrieMatch
+ *
+ *	@param t compiled keywords
+ *	@param s text starting at a token boundary, NUL terminated
+ *	@param hlclass set to the keyword's highlight class
+ *
+ *	Length of the keyword s starts with if it is followed by a separator,
+ *	otherwise 0. Costs one step per byte of the token.
+ */
+int editorTrieMatch(const struct kwtrie *t, const char *s, unsigned char *hlclass)
+{
+	int node = 0, j, c;
+
+	for (j = 0; ; j++)
+	{
+		if (t->accept[node] && is_separator((unsigned char) s[j]))
+		{
+			*hlclass = t->accept[node];
+			return j;
+		}
+
+		c = t->cls[(unsigned char) s[j]];
+		if (c == 0 || (node = t->trans[node * t->width + c]) == 0)
+		{
+			return 0;
+		}
+	}
+}
+
+/**
+ *	editorLexStateIn
+ *
+ *	@param state set to the state a row starts in
+ *	@param prev row before it, NULL for the first row
+ *
+ */
+void editorLexStateIn(struct lexstate *state, erow *prev)
+{
+	if (prev != NULL)
+	{
+		*state = prev->hl_out;
+	}
+	else
+	{
+		memset(state, 0, sizeof(*state));
+	}
+}
+
+/**
+ *	editorTextAppend
+ *
+ *	@param s bytes to store
+ *	@param len number of bytes
+ *
+ *	Copy bytes onto the end of the append-only add buffer and return their
+ *	address. Blocks are never moved or freed, so pieces can point at them.
+ */
+const char *editorTextAppend(const char *s, int len)
+{
+	char *dst = editorTextReserve(len);
+
+	memcpy(dst, s, len);
+
+	return dst;
+}
+
+/**
+ *	editorTextReserve
+ *
+ *	@param len number of bytes
+ *
+ *	Claim room for len bytes on the end of the add buffer for the caller
+ *	to fill in, so text built in place isn't copied a second time
+ */
+char *editorTextReserve(int len)
+{
+	struct addblock *blk = editor.text.add;
+	char *dst;
+	int cap;
+
+	if (blk == NULL || blk->cap - blk->len < len)
+	{
+		cap = (len > ADD_BLOCK_SIZE) ? len : ADD_BLOCK_SIZE;
+		blk = malloc(sizeof(struct addblock) + cap);
+		if (blk == NULL)
+		{
+			die("malloc");
+		}
+
+		blk->len = 0;
+		blk->cap = cap;
+		blk->next = editor.text.add;
+		editor.text.add = blk;
+	}
+
+	dst = &blk->data[blk->len];
+	blk->len += len;
+
+	return dst;
+}
+
+/**
+ *	editorTextExtend
+ *
+ *	@param p piece to grow
+ *	@param s bytes to store
+ *	@param len number of bytes
+ *
+ *	Grow a piece in place when it ends exactly at the tail of the add buffer,
+ *	which is the common case when typing. Returns false if it can't.
+ */
+bool editorTextExtend(struct piece *p, const char *s, int len)
+{
+	struct addblock *blk = editor.text.add;
+
+	if (blk == NULL || p->data + p->len != &blk->data[blk->len] || blk->cap - blk->len < len)
+	{
+		return false;
+	}
+
+	memcpy(&blk->data[blk->len], s, len);
+	blk->len += len;
+	p->len += len;
+
+	return true;
+}
+
+/**
+ *	editorRowPieces
+ *
+ *	@param row editor row
+ *
+ *	Unedited rows keep their single piece inline; edited rows own an array
+ */
+struct piece *editorRowPieces(erow *row)
+{
+	return (row->pieces != NULL) ? row->pieces : &row->piece;
+}
+
+/**
+ *	editorRowReservePieces
+ *
+ *	@param row editor row
+ *	@param n number of pieces the row must be able to hold
+ *
+ */
+void editorRowReservePieces(erow *row, int n)
+{
+	if (n <= 1 && row->pieces == NULL)
+	{
+		return;
+	}
+
+	if (row->pieces == NULL)
+	{
+		row->piececap = (n < 4) ? 4 : n;
+		row->pieces = malloc(sizeof(struct piece) * row->piececap);
+
+		if (row->pieces == NULL)
+		{
+			die("malloc");
+		}
+
+		row->pieces[0] = row->piece;
+	}
+	else if (n > row->piececap)
+	{
+		while (row->piececap < n)
+		{
+			row->piececap *= 2;
+		}
+
+		row->pieces = realloc(row->pieces, sizeof(struct piece) * row->piececap);
+	}
+
+	if (row->pieces == NULL)
+	{
+		die("malloc");
+	}
+}
+
+/**
+ *	editorRowSplitPiece
+ *
+ *	@param row editor row
+ *	@param at char position
+ *
+ *	Make sure a piece boundary falls on at and return the index of the
+ *	piece that starts there (npieces when at is the end of the row)
+ */
+int editorRowSplitPiece(erow *row, int at)
+{
+	struct piece *p = editorRowPieces(row);
+	int k, off = 0;
+
+	for (k = 0; k < row->npieces; k++)
+	{
+		if (at == off)
+		{
+			return k;
+		}
+		else if (at < off + p[k].len)
+		{
+			editorRowReservePieces(row, row->npieces + 1);
+			p = editorRowPieces(row);
+			memmove(&p[k + 1], &p[k], sizeof(struct piece) * (row->npieces - k));
+			p[k].len = at - off;
+			p[k + 1].data += at - off;
+			p[k + 1].len -= at - off;
+			row->npieces++;
+			return k + 1;
+		}
+
+		off += p[k].len;
+	}
+
+	return row->npieces;
+}
+
+/**
+ *	editorRowInsertPieces
+ *
+ *	@param row editor row
+ *	@param k piece index to insert before
+ *	@param src pieces to insert
+ *	@param n number of pieces
+ *
+ *	Pieces that continue the one before them are merged into it
+ */
+void editorRowInsertPieces(erow *row, int k, const struct piece *src, int n)
+{
+	struct piece *p;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (src[i].len == 0)
+		{
+			continue;
+		}
+
+		p = editorRowPieces(row);
+		if (k > 0 && p[k - 1].data + p[k - 1].len == src[i].data)
+		{
+			p[k - 1].len += src[i].len;
+		}
+		else
+		{
+			editorRowReservePieces(row, row->npieces + 1);
+			p = editorRowPieces(row);
+			memmove(&p[k + 1], &p[k], sizeof(struct piece) * (row->npieces - k));
+			p[k++] = src[i];
+			row->npieces++;
+		}
+
+		row->size += src[i].len;
+	}
+}
+
+/**
+ *	editorRowTruncate
+ *
+ *	@param row editor row
+ *	@param at new row length
+ *
+ */
+void editorRowTruncate(erow *row, int at)
+{
+	row->npieces = editorRowSplitPiece(row, at);
+	row->size = at;
+}
+
+/**
+ *	editorRowCopy
+ *
+ *	@param row editor row
+ *	@param dst buffer of at least row->size bytes
+ *
+ *	Flatten the row's pieces into dst
+ */
+void editorRowCopy(erow *row, char *dst)
+{
+	struct piece *p = editorRowPieces(row);
+	int k;
+
+	for (k = 0; k < row->npieces; k++)
+	{
+		memcpy(dst, p[k].data, p[k].len);
+		dst += p[k].len;
+	}
+}
+
+/**
+ *	editorRowTreeInit
+ *
+ *	@param none
+ *
+ *	Create the empty root; the root is always an internal node whose
+ *	children are leaves until the first root split
+ */
+void editorRowTreeInit(void)
+{
+	editor.rowroot = calloc(1, sizeof(struct rownode));
+	if (editor.rowroot == NULL)
+	{
+		die("calloc");
+	}
+
+	editor.rowroot->leaves = true;
+}
+
+/**
+ *	editorRowNodeFind
+ *
+ *	@param node internal node
+ *	@param child child to look for
+ *
+ *	Return the slot of child in node
+ */
+int editorRowNodeFind(struct rownode *node, void *child)
+{
+	int i = 0;
+
+	while (node->child[i] != child)
+	{
+		i++;
+	}
+
+	return i;
+}
+
+/**
+ *	editorRowNodeAdjust
+ *
+ *	@param node parent of child
+ *	@param child subtree whose row count changed
+ *	@param delta change in rows
+ *
+ *	Propagate a row count change from child up to the root
+ */
+void editorRowNodeAdjust(struct rownode *node, void *child, int delta)
+{
+	while (node != NULL)
+	{
+		node->counts[editorRowNodeFind(node, child)] += delta;
+		child = node;
+		node = node->parent;
+	}
+}
+
+/**
+ *	editorRowLocate
+ *
+ *	@param at row index, may equal numrows
+ *	@param pos set to the position inside the returned leaf
+ *
+ *	Descend to the leaf holding row at in O(log n)
+ */
+struct rowleaf *editorRowLocate(int at, int *pos)
+{
+	struct rownode *node = editor.rowroot;
+	int i;
+
+	while (true)
+	{
+		for (i = 0; i < node->nchild - 1 && at >= node->counts[i]; i++)
+		{
+			at -= node->counts[i];
+		}
+
+		if (node->nchild == 0)
+		{
+			return NULL;
+		}
+		else if (node->leaves)
+		{
+			*pos = at;
+			return node->child[i];
+		}
+
+		node = node->child[i];
+	}
+}
+
+/**
+ *	editorRowAt
+ *
+ *	@param at row index
+ *
+ *	Row pointers stay valid only until the next row insert or delete
+ */
+erow *editorRowAt(int at)
+{
+	struct rowleaf *leaf;
+	int pos;
+
+	if (at < 0 || at >= editor.numrows)
+	{
+		return NULL;
+	}
+
+	leaf = editorRowLocate(at, &pos);
+	return &leaf->rows[pos];
+}
+
+/**
+ *	editorRowIndex
+ *
+ *	@param row editor row
+ *
+ *	Derive a row's index by summing the counts left of its path
+ */
+int editorRowIndex(erow *row)
+{
+	struct rownode *node = row->leaf->parent;
+	void *child = row->leaf;
+	int idx = row - row->leaf->rows;
+	int i;
+
+	while (node != NULL)
+	{
+		for (i = 0; node->child[i] != child; i++)
+		{
+			idx += node->counts[i];
+		}
+
+		child = node;
+		node = node->parent;
+	}
+
+	return idx;
+}
+
+/**
+ *	editorRowNext
+ *
+ *	@param row editor row
+ *
+ *	Step to the following row through the leaf chain, NULL at the end
+ */
+erow *editorRowNext(erow *row)
+{
+	struct rowleaf *leaf = row->leaf;
+
+	if (row + 1 < &leaf->rows[leaf->count])
+	{
+		return row + 1;
+	}
+
+	leaf = leaf->next;
+	return (leaf != NULL) ? &leaf->rows[0] : NULL;
+}
+
+/**
+ *	editorRowPrev
+ *
+ *	@param row editor row
+ *
+ */
+erow *editorRowPrev(erow *row)
+{
+	struct rowleaf *leaf = row->leaf;
+
+	if (row > &leaf->rows[0])
+	{
+		return row - 1;
+	}
+
+	leaf = leaf->prev;
+	return (leaf != NULL) ? &leaf->rows[leaf->count - 1] : NULL;
+}
+
+/**
+ *	editorRowNodeInsert
+ *
+ *	@param node internal node
+ *	@param slot slot to insert at
+ *	@param child new child
+ *	@param count rows in child
+ *
+ *	Insert a child, splitting node (and its ancestors) when it is full
+ */
+void editorRowNodeInsert(struct rownode *node, int slot, void *child, int count)
+{
+	struct rownode *sibling, *root;
+	int half, i, moved = 0;
+
+	if (node->nchild == ROWTREE_FANOUT)
+	{
+		sibling = calloc(1, sizeof(struct rownode));
+		if (sibling == NULL)
+		{
+			die("calloc");
+		}
+
+		half = ROWTREE_FANOUT / 2;
+		sibling->leaves = node->leaves;
+		sibling->nchild = node->nchild - half;
+		memcpy(sibling->child, &node->child[half], sizeof(void *) * sibling->nchild);
+		memcpy(sibling->counts, &node->counts[half], sizeof(int) * sibling->nchild);
+		node->nchild = half;
+
+		for (i = 0; i < sibling->nchild; i++)
+		{
+			moved += sibling->counts[i];
+			if (sibling->leaves)
+			{
+				((struct rowleaf *) sibling->child[i])->parent = sibling;
+			}
+			else
+			{
+				((struct rownode *) sibling->child[i])->parent = sibling;
+			}
+		}
+
+		if (node->parent == NULL)
+		{
+			root = calloc(1, sizeof(struct rownode));
+			if (root == NULL)
+			{
+				die("calloc");
+			}
+
+			root->nchild = 1;
+			root->child[0] = node;
+			for (i = 0; i < node->nchild; i++)
+			{
+				root->counts[0] += node->counts[i];
+			}
+
+			root->counts[0] += moved;
+			node->parent = root;
+			editor.rowroot = root;
+		}
+
+		editorRowNodeAdjust(node->parent, node, -moved);
+		sibling->parent = node->parent;
+		editorRowNodeInsert(node->parent, editorRowNodeFind(node->parent, node) + 1, sibling, moved);
+
+		if (slot > half)
+		{
+			node = sibling;
+			slot -= half;
+		}
+	}
+
+	memmove(&node->child[slot + 1], &node->child[slot], sizeof(void *) * (node->nchild - slot));
+	memmove(&node->counts[slot + 1], &node->counts[slot], sizeof(int) * (node->nchild - slot));
+	node->child[slot] = child;
+	node->counts[slot] = 0;
+	node->nchild++;
+
+	if (node->leaves)
+	{
+		((struct rowleaf *) child)->parent = node;
+	}
+	else
+	{
+		((struct rownode *) child)->parent = node;
+	}
+
+	editorRowNodeAdjust(node, child, count);
+}
+
+/**
+ *	editorRowNodeRemove
+ *
+ *	@param node internal node
+ *	@param child empty child to unlink and free
+ *
+ */
+void editorRowNodeRemove(struct rownode *node, void *child)
+{
+	int slot = editorRowNodeFind(node, child);
+
+	free(child);
+	memmove(&node->child[slot], &node->child[slot + 1], sizeof(void *) * (node->nchild - slot - 1));
+	memmove(&node->counts[slot], &node->counts[slot + 1], sizeof(int) * (node->nchild - slot - 1));
+	node->nchild--;
+
+	if (node->nchild == 0 && node->parent != NULL)
+	{
+		editorRowNodeRemove(node->parent, node);
+	}
+	else if (node->nchild == 0)
+	{
+		node->leaves = true;
+	}
+	else if (node == editor.rowroot && node->nchild == 1 && !node->leaves)
+	{
+		editor.rowroot = node->child[0];
+		editor.rowroot->parent = NULL;
+		free(node);
+	}
+}
+
+/**
+ *	editorRowLeafSplit
+ *
+ *	@param leaf full leaf
+ *
+ *	Move the upper half of leaf into a new leaf linked after it
+ */
+void editorRowLeafSplit(struct rowleaf *leaf)
+{
+	struct rowleaf *sibling = malloc(sizeof(struct rowleaf));
+	int half = ROWS_PER_LEAF / 2;
+	int i;
+
+	if (sibling == NULL)
+	{
+		die("malloc");
+	}
+
+	sibling->count = leaf->count - half;
+	memcpy(sibling->rows, &leaf->rows[half], sizeof(erow) * sibling->count);
+	for (i = 0; i < sibling->count; i++)
+	{
+		sibling->rows[i].leaf = sibling;
+	}
+
+	leaf->count = half;
+	sibling->prev = leaf;
+	sibling->next = leaf->next;
+	if (leaf->next != NULL)
+	{
+		leaf->next->prev = sibling;
+	}
+
+	leaf->next = sibling;
+
+	editorRowNodeAdjust(leaf->parent, leaf, -sibling->count);
+	editorRowNodeInsert(leaf->parent, editorRowNodeFind(leaf->parent, leaf) + 1, sibling, sibling->count);
+}
+
+/**
+ *	editorRowTreeInsert
+ *
+ *	@param at row index, 0..numrows
+ *
+ *	Open an uninitialized slot for a new row and return it
+ */
+erow *editorRowTreeInsert(int at)
+{
+	struct rowleaf *leaf;
+	int pos;
+
+	if (editor.numrows == 0)
+	{
+		leaf = malloc(sizeof(struct rowleaf));
+		if (leaf == NULL)
+		{
+			die("malloc");
+		}
+
+		leaf->count = 0;
+		leaf->prev = NULL;
+		leaf->next = NULL;
+		editorRowNodeInsert(editor.rowroot, 0, leaf, 0);
+		pos = 0;
+	}
+	else
+	{
+		leaf = editorRowLocate(at, &pos);
+	}
+
+	if (leaf->count == ROWS_PER_LEAF)
+	{
+		editorRowLeafSplit(leaf);
+		if (pos > leaf->count)
+		{
+			pos -= leaf->count;
+			leaf = leaf->next;
+		}
+	}
+
+	memmove(&leaf->rows[pos + 1], &leaf->rows[pos], sizeof(erow) * (leaf->count - pos));
+	leaf->count++;
+	leaf->rows[pos].leaf = leaf;
+	editorRowNodeAdjust(leaf->parent, leaf, 1);
+
+	return &leaf->rows[pos];
+}
+
+/**
+ *	editorRowTreeDelete
+ *
+ *	@param at row index
+ *
+ *	Drop a row slot, merging sparse leaves into their right neighbour
+ */
+void editorRowTreeDelete(int at)
+{
+	struct rowleaf *leaf, *next;
+	int pos, j;
+
+	leaf = editorRowLocate(at, &pos);
+	memmove(&leaf->rows[pos], &leaf->rows[pos + 1], sizeof(erow) * (leaf->count - pos - 1));
+	leaf->count--;
+	editorRowNodeAdjust(leaf->parent, leaf, -1);
+
+	next = leaf->next;
+	if (leaf->count > 0 && next != NULL && next->parent == leaf->parent &&
+		leaf->count + next->count <= ROWS_PER_LEAF / 2)
+	{
+		memcpy(&leaf->rows[leaf->count], next->rows, sizeof(erow) * next->count);
+		for (j = leaf->count; j < leaf->count + next->count; j++)
+		{
+			leaf->rows[j].leaf = leaf;
+		}
+
+		editorRowNodeAdjust(leaf->parent, leaf, next->count);
+		editorRowNodeAdjust(next->parent, next, -next->count);
+		leaf->count += next->count;
+		next->count = 0;
+		leaf = next;
+	}
+
+	if (leaf->count == 0)
+	{
+		if (leaf->prev != NULL)
+		{
+			leaf->prev->next = leaf->next;
+		}
+
+		if (leaf->next != NULL)
+		{
+			leaf->next->prev = leaf->prev;
+		}
+
+		editorRowNodeRemove(leaf->parent, leaf);
+	}
+}
+
+/**
+ *	editorRowInit
+ *
+ *	@param row freshly inserted row slot
+ *	@param string row text, must live in the piece table buffers
+ *	@param len string length
+ *
+ */
+void editorRowInit(erow *row, const char *string, size_t len)
+{
+	row->size = len;
+	row->npieces = (len > 0) ? 1 : 0;
+	row->piececap = 0;
+	row->pieces = NULL;
+	row->piece.data = string;
+	row->piece.len = len;
+
+	row->rsize = 0;
+	row->render = NULL;
+	row->hl = NULL;
+	row->flags = ROW_DIRTY;
+	memset(&row->hl_in, 0, sizeof(row->hl_in));
+	memset(&row->hl_out, 0, sizeof(row->hl_out));
+	row->hl_seq = 0;
+	row->hl_gen = editor.hl_gen;
+}
+
+/**
+ *	editorInsertRow
+ *
+ *	@param at editor row character position
+ *	@param string row text, must live in the piece table buffers
+ *	@param len string length 
+ *
+ */
+void editorInsertRow(int at, const char *string, size_t len)
+{
+	erow *row;
+
+	if (at < 0 || at > editor.numrows)
+	{
+		return;
+	}
+	else
+	{
+		row = editorRowTreeInsert(at);
+		editorRowInit(row, string, len);
+		editor.numrows++;
+		editorUpdateRow(row);
+		editor.dirty++;
+	}
+}
+
+/**
+ *	editorRowHlValid
+ *
+ *	@param row editor row
+ *	@param prev row before it, NULL for the first row
+ *
+ *	A row's highlight state is current when its text and the syntax are
+ *	unchanged since it was lexed and it was lexed with the lexer state
+ *	its predecessor now ends with
+ */
+bool editorRowHlValid(erow *row, erow *prev)
+{
+	struct lexstate in;
+
+	editorLexStateIn(&in, prev);
+
+	return !(row->flags & ROW_DIRTY) && row->hl_gen == editor.hl_gen &&
+		row->hl_in.comment == in.comment && row->hl_in.string == in.string;
+}
+
+/**
+ *	editorSyntaxAdvance
+ *
+ *	@param upto row index the frontier should reach
+ *
+ *	Work through the rows from the highlight frontier on. Every row
+ *	before the frontier has a valid outgoing lexer state; rows whose
+ *	incoming state still matches are passed over without lexing, so a
+ *	change stops spreading at the first row it doesn't affect. At most
+ *	hl_budget rows are lexed per frame; rows drawn beyond the frontier
+ *	are lexed provisionally and fixed up on later frames. Rows that have
+ *	to be lexed on the way but aren't cached are dropped again after.
+ */
+void editorSyntaxAdvance(int upto)
+{
+	erow *row, *prev;
+	bool cached;
+
+	if (editor.hl_frontier >= upto)
+	{
+		return;
+	}
+
+	row = editorRowAt(editor.hl_frontier);
+	prev = (row != NULL) ? editorRowPrev(row) : NULL;
+	while (row != NULL && editor.hl_frontier < upto)
+	{
+		if (!editorRowHlValid(row, prev))
+		{
+			if (editor.hl_budget == 0)
+			{
+				editor.hl_behind = true;
+				return;
+			}
+
+			editor.hl_budget--;
+			cached = (row->render != NULL);
+			editorRowRender(row);
+			editorUpdateSyntax(row);
+			if (!cached)
+			{
+				editorRowDropCache(row);
+			}
+		}
+
+		editor.hl_frontier++;
+		prev = row;
+		row = editorRowNext(row);
+	}
+}
+
+/**
+ *	editorRowEnsure
+ *
+ *	@param row editor row
+ *	@param lazy leave rows the frontier hasn't reached to the worker
+ *
+ *	Build render and highlight data for a row about to be drawn or
+ *	searched, catching the highlight frontier up to it first. Returns
+ *	false if the row has no usable highlight yet.
+ */
+bool editorRowEnsure(erow *row, bool lazy)
+{
+	int idx = editorRowIndex(row);
+	erow *prev = editorRowPrev(row);
+
+	editorSyntaxAdvance(idx);
+	editorRowRender(row);
+	if (row->hl == NULL || !editorRowHlValid(row, prev))
+	{
+		if (lazy && editor.hlw.running && editor.hl_frontier < idx && !editorRowHlValid(row, prev))
+		{
+			return false;
+		}
+
+		editorUpdateSyntax(row);
+	}
+
+	if (editor.hl_frontier == idx)
+	{
+		editor.hl_frontier++;
+	}
+
+	return true;
+}
+
+/**
+ *	editorHlStart
+ *
+ *	@param none
+ *
+ *	Start the highlight worker. Without it rows past the frontier are
+ *	lexed provisionally on the main thread instead.
+ */
+void editorHlStart(void)
+{
+	struct hlworker *w = &editor.hlw;
+	pthread_t thread;
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&thread, NULL, editorHlThread, NULL) == 0)
+	{
+		pthread_detach(thread);
+		w->running = true;
+	}
+}
+
+/**
+ *	editorHlThread
+ *
+ *	@param arg unused
+ *
+ *	Lex queued jobs outside the editor lock and hand the results back. A
+ *	job is a run of rows copied by the main thread, so nothing here reads
+ *	editor state.
+ */
+void *editorHlThread(void *arg)
+{
+	struct hlworker *w = &editor.hlw;
+	struct hljob *job, **tail;
+	int i;
+
+	(void) arg;
+
+	pthread_mutex_lock(&w->lock);
+	while (true)
+	{
+		while (w->todo == NULL)
+		{
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+
+		job = w->todo;
+		w->todo = job->next;
+		pthread_mutex_unlock(&w->lock);
+
+		for (i = 0; i < job->nrows; i++)
+		{
+			editorLexRow(job->syntax, &job->text[job->offsets[i]], job->offsets[i + 1] - job->offsets[i] - 1, \
+				&job->hl[job->offsets[i]], &job->states[i], &job->states[i + 1]);
+		}
+
+		pthread_mutex_lock(&w->lock);
+		job->next = NULL;
+		for (tail = &w->done; *tail != NULL; tail = &(*tail)->next)
+		{
+		}
+
+		*tail = job;
+		editorWake('h');
+	}
+
+	return NULL;
+}
+
+/**
+ *	editorHlQueue
+ *
+ *	@param first index of the first row
+ *	@param nrows number of rows
+ *	@param viewport whether the rows are on screen, which puts the job
+ *	ahead of the others
+ *
+ *	Copy a run of rows into a job for the worker. The first row starts in
+ *	the state its predecessor ends in now; the result is only kept for
+ *	rows whose predecessor still ends that way when it comes back.
+ */
+void editorHlQueue(int first, int nrows, bool viewport)
+{
+	struct hlworker *w = &editor.hlw;
+	struct hljob *job;
+	struct abuf text = ABUF_INIT;
+	erow *row;
+	bool cached;
+	int i;
+
+	row = editorRowAt(first);
+	if (row == NULL)
+	{
+		return;
+	}
+
+	job = malloc(sizeof(struct hljob));
+	if (job == NULL)
+	{
+		die("malloc");
+	}
+
+	job->seq = editor.hl_seq + 1;
+	job->gen = editor.hl_gen;
+	job->syntax = editor.syntax;
+	job->first = first;
+	job->viewport = viewport;
+	job->offsets = malloc(sizeof(int) * (nrows + 1));
+	job->states = malloc(sizeof(struct lexstate) * (nrows + 1));
+	if (job->offsets == NULL || job->states == NULL)
+	{
+		die("malloc");
+	}
+
+	editorLexStateIn(&job->states[0], editorRowPrev(row));
+	for (i = 0; i < nrows && row != NULL; i++, row = editorRowNext(row))
+	{
+		cached = (row->render != NULL);
+		editorRowRender(row);
+		job->offsets[i] = text.len;
+		abAppend(&text, row->render, row->rsize + 1);
+		if (!cached)
+		{
+			editorRowDropCache(row);
+		}
+
+		// each row gets its own tag so a row shifted by an insert can't match
+		row->hl_seq = job->seq + i;
+	}
+
+	job->nrows = i;
+	editor.hl_seq += i;
+	job->offsets[i] = text.len;
+	job->text = text.b;
+	job->hl = malloc(text.len + 1);
+	if (job->hl == NULL)
+	{
+		die("malloc");
+	}
+
+	if (viewport)
+	{
+		editor.hl_viewport_queued = true;
+	}
+	else
+	{
+		editor.hl_background_queued = true;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	if (viewport)
+	{
+		job->next = w->todo;
+		w->todo = job;
+	}
+	else
+	{
+		struct hljob **tail;
+
+		for (tail = &w->todo; *tail != NULL; tail = &(*tail)->next)
+		{
+		}
+
+		job->next = NULL;
+		*tail = job;
+	}
+
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ *	editorHlCollect
+ *
+ *	@param none
+ *
+ *	Take finished jobs from the worker and apply them in the order they
+ *	were done
+ */
+void editorHlCollect(void)
+{
+	struct hlworker *w = &editor.hlw;
+	struct hljob *job, *next;
+
+	if (!w->running)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	job = w->done;
+	w->done = NULL;
+	pthread_mutex_unlock(&w->lock);
+
+	for (; job != NULL; job = next)
+	{
+		next = job->next;
+		editorHlApply(job);
+		editorHlJobFree(job);
+	}
+}
+
+/**
+ *	editorHlApply
+ *
+ *	@param job finished job
+ *
+ *	Keep a row's result if the row hasn't been edited or queued again
+ *	since and it was lexed from the state its predecessor ends in now.
+ *	Rows without cached render data only keep their lexer state.
+ */
+void editorHlApply(struct hljob *job)
+{
+	struct lexstate in;
+	erow *row, *prev;
+	int i;
+
+	if (job->viewport)
+	{
+		editor.hl_viewport_queued = false;
+	}
+	else
+	{
+		editor.hl_background_queued = false;
+	}
+
+	if (job->gen != editor.hl_gen || job->first >= editor.numrows)
+	{
+		return;
+	}
+
+	row = editorRowAt(job->first);
+	prev = editorRowPrev(row);
+	for (i = 0; i < job->nrows && row != NULL; i++, prev = row, row = editorRowNext(row))
+	{
+		if (row->hl_seq != job->seq + i)
+		{
+			continue;
+		}
+
+		row->hl_seq = 0;
+		editorLexStateIn(&in, prev);
+		if (in.comment != job->states[i].comment || in.string != job->states[i].string)
+		{
+			continue;
+		}
+
+		row->hl_in = job->states[i];
+		row->hl_out = job->states[i + 1];
+		row->hl_gen = job->gen;
+		row->flags &= ~ROW_DIRTY;
+
+		if (row->render != NULL)
+		{
+			if (row->hl == NULL)
+			{
+				editor.stats.allocs++;
+			}
+
+			row->hl = realloc(row->hl, row->rsize + 1);
+			memcpy(row->hl, &job->hl[job->offsets[i]], row->rsize);
+		}
+	}
+}
+
+/**
+ *	editorHlSchedule
+ *
+ *	@param none
+ *
+ *	After a frame, queue the rows it had to draw plain, then the next run
+ *	of rows past the frontier. One job of each kind is in flight at most.
+ */
+void editorHlSchedule(void)
+{
+	if (!editor.hlw.running || editor.syntax == NULL)
+	{
+		return;
+	}
+
+	if (editor.hl_plain_first != -1 && !editor.hl_viewport_queued)
+	{
+		editorHlQueue(editor.hl_plain_first, editor.hl_plain_last - editor.hl_plain_first + 1, true);
+	}
+
+	if (editor.hl_frontier < editor.numrows && !editor.hl_background_queued)
+	{
+		editorSyntaxAdvance(editor.numrows);
+		if (editor.hl_frontier < editor.numrows)
+		{
+			editorHlQueue(editor.hl_frontier, HL_JOB_ROWS, false);
+		}
+	}
+}
+
+/**
+ *	editorHlJobFree
+ *
+ *	@param job job to free
+ *
+ */
+void editorHlJobFree(struct hljob *job)
+{
+	free(job->offsets);
+	free(job->text);
+	free(job->hl);
+	free(job->states);
+	free(job);
+}
+
+/**
+ *	editorRowDropCache
+ *
+ *	@param row editor row
+ *
+ *	Free a row's derived render and highlight data; the comment state is
+ *	kept so the frontier stays where it is
+ */
+void editorRowDropCache(erow *row)
+{
+	if (row->render != NULL)
+	{
+		editor.cache_bytes -= 2 * (row->rsize + 1);
+	}
+
+	free(row->render);
+	free(row->hl);
+	row->render = NULL;
+	row->hl = NULL;
+	row->rsize = 0;
+}
+
+/**
+ *	editorCacheTrim
+ *
+ *	@param none
+ *
+ *	Once derived data grows past its budget, evict it from every row
+ *	outside the viewport. Row pointers other than visible ones held by the
+ *	caller are invalid afterwards.
+ */
+void editorCacheTrim(void)
+{
+	erow *row;
+	int j = 0;
+
+	if (editor.cache_bytes <= RENDER_CACHE_BUDGET)
+	{
+		return;
+	}
+
+	for (row = editorRowAt(0); row != NULL; row = editorRowNext(row), j++)
+	{
+		if (row->render != NULL && (j < editor.rowoff || j >= editor.rowoff + editor.screenrows))
+		{
+			editorRowDropCache(row);
+		}
+	}
+}
+
+/**
+ *	editorRowAppendRow
+ *
+ *	@param row editor row
+ *	@param src row whose text is appended, left untouched
+ *
+ */
+void editorRowAppendRow(erow *row, erow *src)
+{
+	editorRowInsertPieces(row, row->npieces, editorRowPieces(src), src->npieces);
+	editorUpdateRow(row);
+	editor.dirty++;
+}
+
+/**
+ *	editorFreeRow
+ *
+ *	@param row editor row
+ *
+ */
+void editorFreeRow(erow *row)
+{
+	editorRowDropCache(row);
+	free(row->pieces);
+}
+
+/**
+ *	editorDelRow
+ *
+ *	@param at editor row character position
+ *
+ */
+void editorDelRow(int at)
+{
+	if (at < 0 || at >= editor.numrows)
+	{
+		return;
+	}
+	else
+	{
+		editorFreeRow(editorRowAt(at));
+		editorRowTreeDelete(at);
+		if (at < editor.hl_frontier)
+		{
+			editor.hl_frontier = at;
+		}
+
+		editor.numrows--;
+		editor.dirty++;
+	}
+}
+
+/**
+ *	editorCursorLoaded
+ *
+ *	@param none
+ *
+ *	The row past the last one only means end of file once loading is done;
+ *	refuse edits there until then
+ */
+bool editorCursorLoaded(void)
+{
+	if (editor.cy == editor.numrows && editor.loading)
+	{
+		editorSetStatusMessage("Can't edit past the loaded rows while the file is loading");
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ *	editorInsertNewLine
+ *
+ *	@param none
+ *
+ *	Splitting a row moves its tail pieces, no text is copied
+ */
+void editorInsertNewLine(void)
+{
+	erow *row, *next;
+	int k;
+
+	if (!editorCursorLoaded())
+	{
+		return;
+	}
+
+	editorUndoRecord(UNDO_SPLIT, editor.cy, editor.cx, NULL, 0, false);
+	if (editor.cx == 0)
+	{
+		editorInsertRow(editor.cy, "", 0);
+	}
+	else
+	{
+		editorInsertRow(editor.cy + 1, "", 0);
+		row = editorRowAt(editor.cy);
+		next = editorRowNext(row);
+		k = editorRowSplitPiece(row, editor.cx);
+		editorRowInsertPieces(next, 0, &editorRowPieces(row)[k], row->npieces - k);
+		editorUpdateRow(next);
+		editorRowTruncate(row, editor.cx);
+		editorUpdateRow(row);
+	}
+
+	editor.cy++;
+	editor.cx = 0;
+}
+
+/**
+ *	editorRowInsertChar
+ *
+ *	@param row editor row
+ *	@param at char position
+ *	@param ch character
+ *
+ */
+void editorRowInsertChar(erow *row, int at, int ch)
+{
+	struct piece p;
+	char c = ch;
+	int k;
+
+	if (at < 0 || at > row->size)
+	{
+		at = row->size;
+	}
+
+	k = editorRowSplitPiece(row, at);
+	if (k == 0 || !editorTextExtend(&editorRowPieces(row)[k - 1], &c, 1))
+	{
+		p.data = editorTextAppend(&c, 1);
+		p.len = 1;
+		editorRowInsertPieces(row, k, &p, 1);
+	}
+	else
+	{
+		row->size++;
+	}
+
+	editorUpdateRow(row);
+	editor.dirty++;
+}
+
+/**
+ *	editorInsertChar
+ * 
+ *	@param ch character
+ *
+ */
+void editorInsertChar(int ch)
+{
+	char c = ch;
+
+	if (!editorCursorLoaded())
+	{
+		return;
+	}
+	else if (editor.cy == editor.numrows)
+	{
+		editorUndoRecord(UNDO_SPLIT, editor.cy, 0, NULL, 0, false);
+		editorInsertRow(editor.numrows, "", 0);
+	}
+
+	editorUndoRecord(UNDO_INSERT, editor.cy, editor.cx, &c, 1, false);
+	editorRowInsertChar(editorRowAt(editor.cy), editor.cx, ch);
+	editor.cx++;
+}
+
+/**
+ *	editorInsertText
+ *
+ *	@param s text, lines separated by newlines
+ *	@param len length of text
+ *
+ *	Insert a block of text at the cursor in one step
+ */
+void editorInsertText(const char *s, int len)
+{
+	if (len == 0 || !editorCursorLoaded())
+	{
+		return;
+	}
+
+	editorInsertStored(editorTextAppend(s, len), len);
+}
+
+/**
+ *	editorInsertStored
+ *
+ *	@param stored text already in the add buffer
+ *	@param len length of text
+ *
+ *	The body of editorInsertText. Every new row is a piece of the stored
+ *	text; the row the cursor is on keeps its head and the last new row
+ *	takes its tail. Undo keeps a reference to the text rather than a copy.
+ */
+void editorInsertStored(const char *stored, int len)
+{
+	const char *p, *end, *eol;
+	struct piece first;
+	erow *row, *last;
+	int at, k, n;
+
+	if (editor.cy == editor.numrows)
+	{
+		editorUndoRecord(UNDO_SPLIT, editor.cy, 0, NULL, 0, false);
+		editorInsertRow(editor.numrows, "", 0);
+	}
+
+	editorUndoRecord(UNDO_INSERT, editor.cy, editor.cx, stored, len, true);
+	end = stored + len;
+	first.data = stored;
+	eol = memchr(stored, '\n', len);
+	first.len = (eol != NULL) ? eol - stored : len;
+
+	row = editorRowAt(editor.cy);
+	k = editorRowSplitPiece(row, editor.cx);
+	if (eol == NULL)
+	{
+		editorRowInsertPieces(row, k, &first, 1);
+		editorUpdateRow(row);
+		editor.cx += len;
+		editor.dirty++;
+		return;
+	}
+
+	// the last line goes in first so the cursor row's tail can move to it
+	for (p = end; p > eol + 1 && p[-1] != '\n'; p--)
+	{
+	}
+
+	last = editorRowTreeInsert(editor.cy + 1);
+	editorRowInit(last, p, end - p);
+	editor.numrows++;
+	row = editorRowAt(editor.cy);
+	editorRowInsertPieces(last, last->npieces, &editorRowPieces(row)[k], row->npieces - k);
+	editorRowTruncate(row, editor.cx);
+	editorRowInsertPieces(row, k, &first, 1);
+	editorUpdateRow(row);
+
+	at = editor.cy + 1;
+	for (eol++; eol < p; eol += n + 1)
+	{
+		n = (const char *) memchr(eol, '\n', p - eol) - eol;
+		row = editorRowTreeInsert(at++);
+		editorRowInit(row, eol, n);
+		editor.numrows++;
+	}
+
+	editor.cy = at;
+	editor.cx = end - p;
+	editor.dirty++;
+}
+
+/**
+ *	editorPaste
+ *
+ *	@param none
+ *
+ *	Read a bracketed paste and insert it as one block
+ */
+void editorPaste(void)
+{
+	char *text;
+	int len;
+
+	editorUnlock();
+	text = editorInputPaste(&len);
+	editorLock();
+
+	editorInsertText(text, len);
+	free(text);
+}
+
+/**
+ *	editorRowDelChar
+ * 
+ *	@param row editor row
+ *	@param at char position
+ *
+ */
+void editorRowDelChar(erow *row, int at)
+{
+	struct piece *p;
+	int k;
+
+	if (at < 0 || at >= row->size)
+	{
+		return;
+	}
+	else
+	{
+		k = editorRowSplitPiece(row, at);
+		p = editorRowPieces(row);
+		p[k].data++;
+		p[k].len--;
+		if (p[k].len == 0)
+		{
+			memmove(&p[k], &p[k + 1], sizeof(struct piece) * (row->npieces - k - 1));
+			row->npieces--;
+		}
+
+		row->size--;
+		editorUpdateRow(row);
+		editor.dirty++;
+	}
+}
+
+/**
+ *	editorDelChar
+ * 
+ *	@param none
+ *
+ */
+void editorDelChar(void)
+{
+	erow *row = editorRowAt(editor.cy), *prev;
+	char c;
+	int k;
+
+	if (row == NULL)
+	{
+		return;
+	}
+	else if (editor.cx == 0 && editor.cy == 0)
+	{
+		return;
+	}
+	else
+	{
+		if (editor.cx > 0)
+		{
+			k = editorRowSplitPiece(row, editor.cx - 1);
+			c = editorRowPieces(row)[k].data[0];
+			editorUndoRecord(UNDO_DELETE, editor.cy, editor.cx - 1, &c, 1, false);
+			editorRowDelChar(row, editor.cx - 1);
+			editor.cx--;
+		}
+		else
+		{
+			prev = editorRowPrev(row);
+			editorUndoRecord(UNDO_JOIN, editor.cy - 1, prev->size, NULL, 0, false);
+			editor.cx = prev->size;
+			editorRowAppendRow(prev, row);
+			editorDelRow(editor.cy);
+			editor.cy--;
+		}
+	}
+}
+
+/**
+ *	editorDeleteText
+ *
+ *	@param at row the text starts on
+ *	@param cx char position in that row
+ *	@param len bytes to delete, a line break counting as one
+ *
+ *	Delete a block of text in one step, the inverse of editorInsertText.
+ *	The first row keeps its head and takes the last row's tail; the rows
+ *	in between are dropped without looking at their text.
+ */
+void editorDeleteText(int at, int cx, int len)
+{
+	erow *row = editorRowAt(at), *last = row;
+	struct piece *p;
+	int end = cx + len, n = 0, k, j;
+
+	while (end > last->size)
+	{
+		end -= last->size + 1;
+		last = editorRowNext(last);
+		n++;
+	}
+
+	if (n == 0)
+	{
+		k = editorRowSplitPiece(row, cx);
+		j = editorRowSplitPiece(row, end);
+		p = editorRowPieces(row);
+		memmove(&p[k], &p[j], sizeof(struct piece) * (row->npieces - j));
+		row->npieces -= j - k;
+		row->size -= len;
+	}
+	else
+	{
+		editorRowTruncate(row, cx);
+		k = editorRowSplitPiece(last, end);
+		editorRowInsertPieces(row, row->npieces, &editorRowPieces(last)[k], last->npieces - k);
+		while (n-- > 0)
+		{
+			editorDelRow(at + 1);
+		}
+	}
+
+	editorUpdateRow(row);
+	editor.cy = at;
+	editor.cx = cx;
+	editor.dirty++;
+}
+
+/**
+ *	editorUndoRecord
+ *
+ *	@param op enum undoOp
+ *	@param row row the edit is at
+ *	@param cx char position in the row
+ *	@param text bytes inserted or deleted, NULL for a split or join
+ *	@param len number of bytes
+ *	@param ref keep a pointer to text instead of a copy
+ *
+ *	Log an edit about to be made. Everything logged for one key is one
+ *	undo step, and typing or deleting one char at a time grows the last
+ *	record while the keys keep coming in a run. Only text that stays put,
+ *	like the add buffer, can be referenced; anything else is copied.
+ */
+void editorUndoRecord(int op, int row, int cx, const char *text, int len, bool ref)
+{
+	struct undolog *u = &editor.undo;
+	struct undorec *rec;
+	bool first = u->lastkey != u->key, run = u->lastkey + 1 == u->key;
+	int size;
+
+	if (u->replaying)
+	{
+		return;
+	}
+
+	u->lastkey = u->key;
+	if (first)
+	{
+		u->overflow = false;
+	}
+
+	if (u->overflow)
+	{
+		return;
+	}
+
+	// a new edit forgets what could be redone
+	if (u->len > u->at)
+	{
+		u->len = u->at;
+		if (u->saved != UNDO_NOT_SAVED && u->saved > u->at)
+		{
+			u->saved = UNDO_NOT_SAVED;
+		}
+	}
+
+	if ((run || !first) && !ref && len == 1 && editorUndoCoalesce(op, row, cx, text[0]))
+	{
+		return;
+	}
+
+	if (first)
+	{
+		u->group = u->len;
+	}
+
+	size = sizeof(struct undorec) + (ref ? (int) sizeof(const char *) : UNDO_PAD(len));
+	if (!editorUndoReserve(size))
+	{
+		return;
+	}
+
+	rec = (struct undorec *) &u->buf[u->len];
+	rec->op = op;
+	rec->flags = (first ? UNDO_FIRST : 0) | (ref ? UNDO_REF : 0);
+	rec->back = u->prev;
+	rec->row = row;
+	rec->cx = cx;
+	rec->len = len;
+	if (ref)
+	{
+		memcpy(rec + 1, &text, sizeof(text));
+	}
+	else if (len > 0)
+	{
+		memcpy(rec + 1, text, len);
+	}
+
+	u->len += size;
+	u->at = u->len;
+	u->prev = size;
+}
+
+/**
+ *	editorUndoActive
+ *
+ *	@param none
+ *
+ *	Whether edits for the current key are still logged: not while undo is
+ *	replaying, or once the step has been dropped as too big. Callers that
+ *	copy text only to log it check this first.
+ */
+bool editorUndoActive(void)
+{
+	struct undolog *u = &editor.undo;
+
+	return !u->replaying && !(u->overflow && u->lastkey == u->key);
+}
+
+/**
+ *	editorUndoCoalesce
+ *
+ *	@param op enum undoOp
+ *	@param row row the edit is at
+ *	@param cx char position in the row
+ *	@param c the byte inserted or deleted
+ *
+ *	Fold a one byte edit into the last record if it carries on from it:
+ *	typing goes on the end, backspace on the front, delete on the end.
+ *	Returns false if it doesn't.
+ */
+bool editorUndoCoalesce(int op, int row, int cx, char c)
+{
+	struct undolog *u = &editor.undo;
+	struct undorec *rec;
+	char *text;
+	int grow;
 
-					abAppend(ab, &ch[j], 1);
-				}
-				else
-				{
-					color = editorSyntaxToColor(hl[j]);
-					if (color != current_color)
-					{
-						current_color = color;
-						clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-						abAppend(ab, buf, clen);
-					}
+	if (u->at == u->start)
+	{
+		return false;
+	}
 
-					abAppend(ab, &ch[j], 1);
-				}
-			}
+	rec = (struct undorec *) &u->buf[u->at - u->prev];
+	if (rec->op != op || (rec->flags & UNDO_REF) || rec->row != row || rec->len >= UNDO_COALESCE_MAX)
+	{
+		return false;
+	}
+	else if (!(op == UNDO_INSERT && cx == rec->cx + rec->len) && \
+		!(op == UNDO_DELETE && (cx == rec->cx || cx + 1 == rec->cx)))
+	{
+		return false;
+	}
 
-			abAppend(ab, "\x1b[39m", 5);
+	grow = UNDO_PAD(rec->len + 1) - UNDO_PAD(rec->len);
+	if (grow > 0)
+	{
+		if (!editorUndoReserve(grow))
+		{
+			return true;
 		}
 
-		abAppend(ab, "\x1b[K", 3);
-		abAppend(ab, "\r\n", 2);
+		rec = (struct undorec *) &u->buf[u->at - u->prev];
+	}
+
+	text = (char *) (rec + 1);
+	if (cx + 1 == rec->cx)
+	{
+		memmove(text + 1, text, rec->len);
+		text[0] = c;
+		rec->cx = cx;
+	}
+	else
+	{
+		text[rec->len] = c;
 	}
+
+	rec->len++;
+	u->len += grow;
+	u->at = u->len;
+	u->prev += grow;
+
+	return true;
 }
 
 /**
- *	editorScroll
+ *	editorUndoReserve
  *
- *	@param none
+ *	@param size bytes about to be added to the log
  *
+ *	Make room in the log, dropping the oldest steps to stay under the
+ *	limit. A step that doesn't fit even on its own can't be undone; it is
+ *	dropped along with everything before it, and false is returned. The
+ *	limit covers the log itself. Text a record references isn't counted;
+ *	it is the buffer's own text, or for a replace-all over edited rows a
+ *	copy of the rows it changed, made only while the step is kept.
  */
-void editorScroll(void)
+bool editorUndoReserve(int size)
 {
-	editor.rx = 0;
-	if (editor.cy < editor.numrows)
+	struct undolog *u = &editor.undo;
+	size_t off;
+	char *new;
+
+	while (u->len - u->start + size > u->limit && u->start < u->group)
 	{
-		editor.rx = editorRowCxToRx(&editor.row[editor.cy], editor.cx);
+		off = u->start;
+		do
+		{
+			off += editorUndoSize((struct undorec *) &u->buf[off]);
+		}
+		while (off < u->group && !(((struct undorec *) &u->buf[off])->flags & UNDO_FIRST));
+
+		u->start = off;
 	}
 
-	if (editor.cy < editor.rowoff)
+	if (u->len - u->start + size > u->limit)
 	{
-		editor.rowoff = editor.cy;
+		u->start = u->at = u->len = u->group;
+		u->prev = 0;
+		u->overflow = true;
+		u->saved = UNDO_NOT_SAVED;
+		editorSetStatusMessage("That change is too big to undo");
+		return false;
 	}
 
-	if (editor.cy >= editor.rowoff + editor.screenrows)
+	if (u->saved != UNDO_NOT_SAVED && u->saved < u->start)
 	{
-		editor.rowoff = editor.cy - editor.screenrows + 1;
+		u->saved = UNDO_NOT_SAVED;
 	}
 
-	if (editor.rx < editor.coloff)
+	// slide the live records down before growing
+	if (u->len + size > u->cap && u->start > 0)
 	{
-		editor.coloff = editor.rx;
+		memmove(u->buf, &u->buf[u->start], u->len - u->start);
+		u->group -= u->start;
+		u->at -= u->start;
+		u->len -= u->start;
+		if (u->saved != UNDO_NOT_SAVED)
+		{
+			u->saved -= u->start;
+		}
+
+		u->start = 0;
 	}
 
-	if (editor.rx >= editor.coloff + editor.screencols)
+	if (u->len + size > u->cap)
 	{
-		editor.coloff = editor.rx - editor.screencols + 1;
+		u->cap = (u->cap * 2 > u->len + size) ? u->cap * 2 : u->len + size + 4096;
+		new = realloc(u->buf, u->cap);
+		if (new == NULL)
+		{
+			die("realloc");
+		}
+
+		u->buf = new;
 	}
+
+	return true;
 }
 
 /**
- *	editorRefreshScreen
+ *	editorUndoSize
  *
- *	@param none
+ *	@param rec undo record
  *
- *	clear screen using Erase In Display
  */
-void editorRefreshScreen(void)
+int editorUndoSize(const struct undorec *rec)
 {
-	struct abuf ab = ABUF_INIT;
-	char buf[32];
+	return sizeof(struct undorec) + ((rec->flags & UNDO_REF) ? (int) sizeof(const char *) : UNDO_PAD(rec->len));
+}
 
-	editorScroll();
+/**
+ *	editorUndoText
+ *
+ *	@param rec undo record
+ *
+ *	The bytes a record inserts or deletes, wherever they are kept
+ */
+const char *editorUndoText(const struct undorec *rec)
+{
+	const char *text;
+
+	if (!(rec->flags & UNDO_REF))
+	{
+		return (const char *) (rec + 1);
+	}
 
-	abAppend(&ab, "\x1b[?25l", 6);
-	abAppend(&ab, "\x1b[H", 3);
+	memcpy(&text, rec + 1, sizeof(text));
 
-	editorDrawRows(&ab);
-	editorDrawStatusBar(&ab);
-	editorDrawMessageBar(&ab);
+	return text;
+}
 
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (editor.cy - editor.rowoff) + 1, (editor.rx - editor.coloff) + 1);
-	abAppend(&ab, buf, strlen(buf));
+/**
+ *	editorUndo
+ *
+ *	@param none
+ *
+ *	Take back the last step, newest record first
+ */
+void editorUndo(void)
+{
+	struct undolog *u = &editor.undo;
+	struct undorec *rec;
+
+	if (u->at == u->start)
+	{
+		editorSetStatusMessage("Nothing to undo");
+		return;
+	}
 
-	abAppend(&ab, "\x1b[?25h", 6);
+	u->replaying = true;
+	do
+	{
+		u->at -= u->prev;
+		rec = (struct undorec *) &u->buf[u->at];
+		u->prev = rec->back;
+		editorUndoApply(rec, true);
+	}
+	while (!(rec->flags & UNDO_FIRST));
 
-	write(STDOUT_FILENO, ab.b, ab.len);
-	abFree(&ab);
+	u->replaying = false;
+	editorUndoDone();
 }
 
 /**
- *	abAppend
+ *	editorRedo
  *
- *	@param ab buffer
- *	@param s string
- *	@param len length of string
- * 
- *	@todo append string to buffer
+ *	@param none
+ *
+ *	Make the step after the last one undone again, oldest record first
  */
-void abAppend(struct abuf *ab, const char *s, int len)
+void editorRedo(void)
 {
-	char *new = realloc(ab->b, ab->len + len);
+	struct undolog *u = &editor.undo;
+	struct undorec *rec;
 
-	if (new == NULL)
+	if (u->at == u->len)
 	{
+		editorSetStatusMessage("Nothing to redo");
 		return;
 	}
-	else
+
+	u->replaying = true;
+	do
 	{
-		memcpy(&new[ab->len], s, len);
-		ab->b = new;
-		ab->len += len;
+		rec = (struct undorec *) &u->buf[u->at];
+		editorUndoApply(rec, false);
+		u->prev = editorUndoSize(rec);
+		u->at += u->prev;
 	}
+	while (u->at < u->len && !(((struct undorec *) &u->buf[u->at])->flags & UNDO_FIRST));
+
+	u->replaying = false;
+	editorUndoDone();
 }
 
 /**
- *	abFree
+ *	editorUndoDone
  *
- *	@param ab buffer
+ *	@param none
  *
- *	@todo free buffer string
+ *	After an undo or redo, stop typing from joining the step just
+ *	replayed, and tell whether the text is back to what was saved
  */
-void abFree(struct abuf *ab)
+void editorUndoDone(void)
 {
-	free(ab->b);
+	editor.undo.lastkey = 0;
+	if (editor.undo.at == editor.undo.saved)
+	{
+		editor.dirty = 0;
+	}
+	else if (editor.dirty == 0)
+	{
+		editor.dirty++;
+	}
 }
 
 /**
- *	getCursorPosition
+ *	editorUndoApply
  *
- *	@param none
+ *	@param rec undo record
+ *	@param undo apply the inverse of the record
  *
+ *	Replay a record through the usual editing calls with the cursor put
+ *	where it happened; the log is left alone while replaying. Inserting
+ *	referenced text reuses it, so redoing a big paste copies nothing, and
+ *	undoing it is one editorDeleteText.
  */
-int getCursorPosition(int *rows, int *cols)
+void editorUndoApply(const struct undorec *rec, bool undo)
 {
-	char buf[32];
-	unsigned int i = 0;
+	int op = rec->op;
 
-	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
+	if (undo)
 	{
-		return -1;
+		op = (op == UNDO_INSERT) ? UNDO_DELETE : (op == UNDO_DELETE) ? UNDO_INSERT : \
+			(op == UNDO_SPLIT) ? UNDO_JOIN : UNDO_SPLIT;
 	}
 
-	while (i < sizeof(buf) - 1)
+	editor.cy = rec->row;
+	editor.cx = rec->cx;
+	switch (op)
 	{
-		if (read(STDIN_FILENO, &buf[i], 1) != 1)
-		{
-			break;
-		}
+		case UNDO_INSERT:
+			{
+				if (rec->flags & UNDO_REF)
+				{
+					editorInsertStored(editorUndoText(rec), rec->len);
+				}
+				else
+				{
+					editorInsertText(editorUndoText(rec), rec->len);
+				}
 
-		if (buf[i] == 'R')
+				break;
+			}
+
+		case UNDO_DELETE:
+			{
+				editorDeleteText(rec->row, rec->cx, rec->len);
+				break;
+			}
+
+		case UNDO_SPLIT:
+			{
+				editorInsertNewLine();
+				break;
+			}
+
+		case UNDO_JOIN:
+			{
+				// a split past the last row added an empty row
+				if (rec->row + 1 >= editor.numrows)
+				{
+					editorDelRow(rec->row);
+				}
+				else
+				{
+					editor.cy = rec->row + 1;
+					editor.cx = 0;
+					editorDelChar();
+				}
+
+				break;
+			}
+	}
+}
+
+/**
+ *	editorUndoSaved
+ *
+ *	@param none
+ *
+ *	Remember where in the log the file was saved, and start a new step
+ *	for the next thing typed
+ */
+void editorUndoSaved(void)
+{
+	editor.undo.saved = editor.undo.at;
+	editor.undo.lastkey = 0;
+}
+
+/**
+ *	editorUndoRebase
+ *
+ *	@param none
+ *
+ *	Records may point at text in the original buffer, which a save
+ *	releases; copy just that text to the add buffer before anything is
+ *	written
+ */
+void editorUndoRebase(void)
+{
+	struct undolog *u = &editor.undo;
+	uintptr_t start = (uintptr_t) editor.text.orig, at;
+	struct undorec *rec;
+	const char *text;
+	size_t off;
+
+	for (off = u->start; off < u->len; off += editorUndoSize(rec))
+	{
+		rec = (struct undorec *) &u->buf[off];
+		at = (uintptr_t) editorUndoText(rec);
+		if ((rec->flags & UNDO_REF) && editor.text.orig != NULL && at >= start && at < start + editor.text.origlen)
 		{
-			break;
+			text = editorTextAppend(editorUndoText(rec), rec->len);
+			memcpy(rec + 1, &text, sizeof(text));
 		}
-
-		i++;
 	}
+}
 
-	buf[i] = '\0';
+/**
+ *	editorRowsToString
+ * 
+ *	@param buflen length of string
+ *
+ */
+char *editorRowsToString(size_t *buflen)
+{
+	size_t totlen = 0;
+	char *buf, *p;
+	erow *row;
 
-	if (buf[0] != '\x1b' || buf[1] != '[')
+	for (row = editorRowAt(0); row != NULL; row = editorRowNext(row))
 	{
-		return -1;
+		totlen += (size_t) row->size + 1;
 	}
 
-	if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
+	*buflen = totlen;
+	buf = malloc(totlen + 1);
+	if (buf == NULL)
 	{
-		return -1;
+		die("malloc");
 	}
 
-	return 0;
+	p = buf;
+
+	for (row = editorRowAt(0); row != NULL; row = editorRowNext(row))
+	{
+		editorRowCopy(row, p);
+		p += row->size;
+		*p = '\n';
+		p++;
+	}
+
+	return buf;
 }
 
 /**
- *	is_separator
+ *	editorUpdateRow
  *
- *	@param ch character
+ *	@param row editor row
  *
+ *	Mark a row's text as changed; render and highlight data are rebuilt
+ *	when the row is next drawn
  */
-bool is_separator(int ch)
+void editorUpdateRow(erow *row)
 {
-	return isspace(ch) || ch == '\0' || strchr(",.()+-/*=~%<>[];", ch) != NULL;
+	editorUpdateRowAt(row, editorRowIndex(row));
 }
 
 /**
- *	editorUpdateSyntax
+ *	editorUpdateRowAt
  *
  *	@param row editor row
+ *	@param at index of the row
  *
- *
+ *	editorUpdateRow for callers that already know where the row is
  */
-void editorUpdateSyntax(erow *row)
+void editorUpdateRowAt(erow *row, int at)
 {
-	int i = 0, j = 0;
-	bool prev_separator = true, in_comment = false, changed;
-	int in_string = 0;
-	int scs_len = 0, mce_len = 0, mcs_len = 0, mcs2_len = 0;
-	bool keyword2;
-	int keyword_len;
-	unsigned char prev_hl;
-	char ch;
-	char *scs, *mcs, *mcs2, *mce;
-	char **keywords;
+	editorRowDropCache(row);
+	row->flags |= ROW_DIRTY;
+	row->hl_seq = 0;
+	if (at < editor.hl_frontier)
+	{
+		editor.hl_frontier = at;
+	}
+}
 
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
+/**
+ *	editorRowRender
+ *
+ *	@param row editor row
+ *
+ *	Expand tabs into the render buffer if the row doesn't have one yet
+ */
+void editorRowRender(erow *row)
+{
+	int j, k, idx = 0, tabs = 0;
+	struct piece *p = editorRowPieces(row);
 
-	if (editor.syntax == NULL)
+	if (row->render != NULL)
 	{
 		return;
 	}
-	else
-	{
-		keywords = editor.syntax->keywords;
-		scs = editor.syntax->singleline_comment_start;
-		mcs = editor.syntax->multi_comment_start;
-		mcs2 = editor.syntax->multi_comment_start2;
-		mce = editor.syntax->multi_comment_end;
 
-		if (scs != NULL)
+	for (k = 0; k < row->npieces; k++)
+	{
+		for (j = 0; j < p[k].len; j++)
 		{
-			scs_len = strlen(scs);
+			if (p[k].data[j] == '\t')
+			{
+				tabs++;
+			}
 		}
+	}
 
-		if (mcs != NULL)
-		{
-			mcs_len = strlen(mcs);
-		}
+	row->render = malloc(row->size + tabs *(TAB_STOP - 1) + 1);
 
-		if (mcs2 != NULL)
+	for (k = 0; k < row->npieces; k++)
+	{
+		for (j = 0; j < p[k].len; j++)
 		{
-			mcs2_len = strlen(mcs2);
+			if (p[k].data[j] == '\t')
+			{
+				row->render[idx++] = ' ';
+				while (idx % TAB_STOP != 0)
+				{
+					row->render[idx++] = ' ';
+				}
+			}
+			else
+			{
+				row->render[idx++] = p[k].data[j];
+			}
 		}
+	}
 
-		if (mce != NULL)
-		{
-			mce_len = strlen(mce);
-		}
+	row->render[idx] = '\0';
+	row->rsize = idx;
+	editor.cache_bytes += 2 * (row->rsize + 1);
+	editor.stats.allocs++;
+}
+
+/**
+ *	editorSyntaxToColor
+ * 
+ *	@param hl highlight color value
+ *
+ *	@todo return ANSI color value
+ */
+int editorSyntaxToColor(int hl)
+{
+	switch (hl)
+	{
+		case HL_COMMENT:
+		case HL_MULTI_COMMENT:
+			{
+				return 36;
+			}
 
-		in_comment = (row->idx > 0 && editor.row[row->idx - 1].hl_open_comment);
+		case HL_STRING:
+			{
+				return 35;
+			}
 
-		while (i < row->rsize)
-		{
-			ch = row->render[i];
+		case HL_KEYWORD1:
+			{
+				return 33;
+			}
 
-			if (i > 0)
+		case HL_KEYWORD2:
 			{
-				prev_hl = row->hl[i - 1];
+				return 32;
 			}
-			else
+
+		case HL_NUMBER:
 			{
-				prev_hl = HL_NORMAL;
+				return 31;
 			}
 
-			if ((scs_len != 0) && !in_string && !in_comment)
+		case HL_MATCH:
 			{
-				if (!strncmp(&row->render[i], scs, scs_len))
-				{
-					memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-					break;
-				}
+				return 34;
 			}
 
-			if ((mcs2_len || mcs_len) && mce_len && (in_string == false))
+		default:
 			{
-				if (in_comment != false)
-				{
-					row->hl[i] = HL_MULTI_COMMENT;
-					if (strncmp(&row->render[i], mce, mce_len) == 0)
-					{
-						memset(&row->hl[i], HL_MULTI_COMMENT, mce_len);
-						i += mce_len;
-						in_comment = false;
-						prev_separator = true;
-						continue;
-					}
-					else
-					{
-						i++;
-						continue;
-					}
-				}
-				else if (strncmp(&row->render[i], mcs, mcs_len) == 0)
-				{
-					memset(&row->hl[i], HL_MULTI_COMMENT, mcs_len);
-					i += mcs_len;
-					in_comment = true;
-					continue;
-				}
-				else if (strncmp(&row->render[i], mcs2, mcs2_len) == 0)
-				{
-					memset(&row->hl[i], HL_MULTI_COMMENT, mcs2_len);
-					i += mcs2_len;
-					in_comment = true;
-					continue;
-				}
+				return 37;
 			}
+	}
+}
 
-			if (editor.syntax->flags &HIGHLIGHT_STRINGS)
+/**
+ *	editorSyntaxLoad
+ *
+ *	@param none
+ *
+ *	Load the syntax definitions in the config directory ahead of the
+ *	built in ones. They are compiled into a cache file the first time and
+ *	whenever a definition changes; otherwise the cache is just mapped.
+ */
+void editorSyntaxLoad(void)
+{
+	struct abuf ab = ABUF_INIT;
+	struct editorSyntax **syn;
+	struct stat st;
+	long long stamp = 0;
+	char *dir, *path, *tmp, **names = NULL;
+	int fd, i, n = 0, nfiles;
+	void *map;
+
+	dir = editorConfigPath(SYNTAX_DIR);
+	path = editorConfigPath(SYNTAX_CACHE);
+	nfiles = (dir != NULL) ? editorSyntaxScan(dir, &names, &stamp) : -1;
+	if (nfiles > 0)
+	{
+		fd = open(path, O_RDONLY);
+		if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED && editorSyntaxMap(map, st.st_size, nfiles, stamp) == -1)
 			{
-				if (in_string != 0)
-				{
-					row->hl[i] = HL_STRING;
-					if (ch == '\\' && i + 1 < row->rsize)
-					{
-						row->hl[i + 1] = HL_STRING;
-						i += 2;
-						continue;
-					}
+				munmap(map, st.st_size);
+			}
+		}
 
-					if (ch == in_string)
-					{
-						in_string = 0;
-					}
+		if (fd != -1)
+		{
+			close(fd);
+		}
 
-					i++;
-					prev_separator = true;
-					continue;
-				}
-				else
-				{
-					if (ch == '"' || ch == '\'')
-					{
-						in_string = ch;
-						row->hl[i] = HL_STRING;
-						i++;
-						continue;
-					}
-				}
+		if (editor.hldb == NULL)
+		{
+			syn = malloc(sizeof(struct editorSyntax *) * nfiles);
+			if (syn == NULL)
+			{
+				die("malloc");
 			}
 
-			if (editor.syntax->flags &HIGHLIGHT_NUMBERS)
+			for (i = 0; i < nfiles; i++)
 			{
-				if ((isdigit(ch) && (prev_separator || prev_hl == HL_NUMBER)) ||
-					(ch == '.' && prev_hl == HL_NUMBER))
+				tmp = malloc(strlen(dir) + strlen(names[i]) + 2);
+				if (tmp == NULL)
 				{
-					row->hl[i] = HL_NUMBER;
-					i++;
-					prev_separator = false;
-					continue;
+					die("malloc");
 				}
+
+				sprintf(tmp, "%s/%s", dir, names[i]);
+				syn[n] = editorSyntaxParse(tmp);
+				n += (syn[n] != NULL);
+				free(tmp);
 			}
 
-			if (prev_separator != 0)
+			editorSyntaxSerialize(&ab, syn, n, nfiles, stamp);
+			for (i = 0; i < n; i++)
 			{
-				for (j = 0; keywords[j]; j++)
-				{
-					keyword_len = strlen(keywords[j]);
-					keyword2 = keywords[j][keyword_len - 1] == '|';
-					if (keyword2 != false)
-					{
-						keyword_len--;
-					}
+				editorSyntaxFree(syn[i]);
+			}
 
-					if (!strncmp(&row->render[i], keywords[j], keyword_len) &&
-						is_separator(row->render[i + keyword_len]))
-					{
-						memset(&row->hl[i], (keyword2 != false) ? HL_KEYWORD2 : HL_KEYWORD1, keyword_len);
-						i += keyword_len;
-						break;
-					}
-				}
+			free(syn);
 
-				if (keywords[j] != NULL)
-				{
-					prev_separator = false;
-					continue;
-				}
-			}
+			// write then rename so a concurrent start never maps half a cache;
+			// failing to write it only means it is rebuilt next time
+			editorSaveTemp(path, NULL, ab.b, ab.len);
 
-			prev_separator = is_separator(ch);
-			i++;
+			// the tables stay in the buffer they were built in
+			editorSyntaxMap(ab.b, ab.len, nfiles, stamp);
 		}
 
-		changed = (row->hl_open_comment != in_comment);
-		row->hl_open_comment = in_comment;
-		if (changed && (row->idx + 1 < editor.numrows))
+		for (i = 0; i < nfiles; i++)
 		{
-			editorUpdateSyntax(&editor.row[row->idx + 1]);
+			free(names[i]);
 		}
 	}
-}
 
-/**
- *	editorInsertRow
- *
- *	@param at editor row character position
- *	@param string
- *	@param len string length 
- *
- */
-void editorInsertRow(int at, char *string, size_t len)
-{
-	if (at < 0 || at > editor.numrows)
-	{
-		return;
-	}
-	else
-	{
-		editor.row = realloc(editor.row, sizeof(erow) *(editor.numrows + 1));
-		memmove(&editor.row[at + 1], &editor.row[at], sizeof(erow) *(editor.numrows - at));
+	free(names);
+	free(dir);
+	free(path);
 
-		for (int j = at + 1; j <= editor.numrows; j++)
+	if (editor.hldb == NULL)
+	{
+		editor.hldb = malloc(sizeof(HLDB));
+		if (editor.hldb == NULL)
 		{
-			editor.row[j].idx++;
+			die("malloc");
 		}
 
-		editor.row[at].idx = at;
-		editor.row[at].size = len;
-		editor.row[at].chars = malloc(len + 1);
-		memcpy(editor.row[at].chars, string, len);
-		editor.row[at].chars[len] = '\0';
-
-		editor.row[at].rsize = 0;
-		editor.row[at].render = NULL;
-		editor.row[at].hl = NULL;
-		editor.row[at].hl_open_comment = false;
-		editorUpdateRow(&editor.row[at]);
-
-		editor.numrows++;
-		editor.dirty++;
+		memcpy(editor.hldb, HLDB, sizeof(HLDB));
+		editor.nsyntaxes = HLDB_ENTRIES;
 	}
 }
 
 /**
- *	editorRowAppendString
+ *	editorConfigPath
  *
- *	@param row editor row
- *	@param string string 
- * 	@param len string length
+ *	@param name file under the editor's config directory
  *
+ *	Allocated path of name, or NULL if there is no home to put it in
  */
-void editorRowAppendString(erow *row, char *string, size_t len)
+char *editorConfigPath(const char *name)
 {
-	row->chars = realloc(row->chars, row->size + len + 1);
-	memcpy(&row->chars[row->size], string, len);
-	row->size += len;
-	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
-	editor.dirty++;
+	const char *base = getenv("XDG_CONFIG_HOME"), *sub = "";
+	char *path;
+
+	if (base == NULL || base[0] == '\0')
+	{
+		base = getenv("HOME");
+		sub = "/.config";
+		if (base == NULL || base[0] == '\0')
+		{
+			return NULL;
+		}
+	}
+
+	path = malloc(strlen(base) + strlen(sub) + strlen(CONFIG_DIR) + strlen(name) + 3);
+	if (path == NULL)
+	{
+		die("malloc");
+	}
+
+	sprintf(path, "%s%s/%s/%s", base, sub, CONFIG_DIR, name);
+
+	return path;
 }
 
 /**
- *	editorFreeRow
+ *	editorSyntaxNameCompare
  *
- *	@param row editor row
+ *	@param a pointer to a file name
+ *	@param b pointer to a file name
  *
  */
-void editorFreeRow(erow *row)
+int editorSyntaxNameCompare(const void *a, const void *b)
 {
-	free(row->render);
-	free(row->chars);
-	free(row->hl);
+	return strcmp(*(char * const *) a, *(char * const *) b);
 }
 
 /**
- *	editorDelRow
+ *	editorSyntaxScan
  *
- *	@param at editor row character position
+ *	@param dir syntax directory
+ *	@param names set to the sorted definition file names
+ *	@param stamp set to the newest change time of the directory or a file
  *
+ *	Number of definitions in dir, -1 if it can't be read. Only stats the
+ *	files, so it is cheap enough to run at every start.
  */
-void editorDelRow(int at)
+int editorSyntaxScan(const char *dir, char ***names, long long *stamp)
 {
-	if (at < 0 || at >= editor.numrows)
+	struct dirent *ent;
+	struct stat st;
+	DIR *d = opendir(dir);
+	char *path, **list = NULL, **new;
+	int n = 0, len, suffix = strlen(SYNTAX_SUFFIX);
+	long long t;
+
+	if (d == NULL || fstat(dirfd(d), &st) == -1)
 	{
-		return;
+		if (d != NULL)
+		{
+			closedir(d);
+		}
+
+		return -1;
 	}
-	else
+
+	*stamp = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	while ((ent = readdir(d)) != NULL)
 	{
-		editorFreeRow(&editor.row[at]);
-		memmove(&editor.row[at], &editor.row[at + 1], sizeof(erow) *(editor.numrows - at - 1));
-		for (int j = at; j < editor.numrows - 1; j++)
+		len = strlen(ent->d_name);
+		if (len <= suffix || strcmp(&ent->d_name[len - suffix], SYNTAX_SUFFIX) != 0)
 		{
-			editor.row[j].idx--;
+			continue;
 		}
 
-		editor.numrows--;
-		editor.dirty++;
+		path = malloc(strlen(dir) + len + 2);
+		new = realloc(list, sizeof(char *) * (n + 1));
+		if (path == NULL || new == NULL)
+		{
+			die("malloc");
+		}
+
+		list = new;
+		sprintf(path, "%s/%s", dir, ent->d_name);
+		if (stat(path, &st) == 0)
+		{
+			t = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+			*stamp = (t > *stamp) ? t : *stamp;
+			list[n++] = strdup(ent->d_name);
+		}
+
+		free(path);
+	}
+
+	closedir(d);
+
+	// earlier names win when two definitions claim a file
+	if (n > 0)
+	{
+		qsort(list, n, sizeof(char *), editorSyntaxNameCompare);
 	}
+
+	*names = list;
+
+	return n;
 }
 
 /**
- *	editorInsertNewLine
+ *	editorSyntaxParse
  *
- *	@param none
+ *	@param path definition file
+ *
+ *	Read a definition of lines of a key followed by words:
+ *
+ *		filetype haskell
+ *		match .hs
+ *		keywords case of if then else let in where data
+ *		types Int Bool True False
+ *		comment --
+ *		comment_start {-
+ *		comment_end -}
+ *		numbers
+ *		strings
+ *		nested_comments
  *
+ *	comment_start2 names a second opener for the same end. Lines
+ *	starting with # and unknown keys are ignored. Returns NULL if
+ *	the file can't be read or lacks a filetype or a match.
  */
-void editorInsertNewLine(void)
+struct editorSyntax *editorSyntaxParse(const char *path)
 {
-	erow * row;
-	if (editor.cx == 0)
+	struct editorSyntax *s;
+	FILE *fp = fopen(path, "r");
+	char *line = NULL, *key, *word, **field;
+	size_t cap = 0;
+
+	if (fp == NULL)
 	{
-		editorInsertRow(editor.cy, "", 0);
+		return NULL;
 	}
-	else
+
+	s = calloc(1, sizeof(struct editorSyntax));
+	if (s == NULL)
 	{
-		row = &editor.row[editor.cy];
-		editorInsertRow(editor.cy + 1, &row->chars[editor.cx], row->size - editor.cx);
-		row = &editor.row[editor.cy];
-		row->size = editor.cx;
-		row->chars[row->size] = '\0';
-		editorUpdateRow(row);
+		die("calloc");
 	}
 
-	editor.cy++;
-	editor.cx = 0;
+	editorSyntaxAddWord(&s->filematch, NULL, false);
+	editorSyntaxAddWord(&s->keywords, NULL, false);
+
+	while (getline(&line, &cap, fp) != -1)
+	{
+		key = strtok(line, " \t\r\n");
+		if (key == NULL || key[0] == '#')
+		{
+			continue;
+		}
+
+		field = NULL;
+		if (strcmp(key, "filetype") == 0)
+		{
+			field = &s->filetype;
+		}
+		else if (strcmp(key, "comment") == 0)
+		{
+			field = &s->singleline_comment_start;
+		}
+		else if (strcmp(key, "comment_start") == 0)
+		{
+			field = &s->multi_comment_start;
+		}
+		else if (strcmp(key, "comment_start2") == 0)
+		{
+			field = &s->multi_comment_start2;
+		}
+		else if (strcmp(key, "comment_end") == 0)
+		{
+			field = &s->multi_comment_end;
+		}
+		else if (strcmp(key, "numbers") == 0)
+		{
+			s->flags |= HIGHLIGHT_NUMBERS;
+		}
+		else if (strcmp(key, "strings") == 0)
+		{
+			s->flags |= HIGHLIGHT_STRINGS;
+		}
+		else if (strcmp(key, "nested_comments") == 0)
+		{
+			s->flags |= HIGHLIGHT_NESTED_COMMENTS;
+		}
+
+		while ((word = strtok(NULL, " \t\r\n")) != NULL)
+		{
+			if (field != NULL)
+			{
+				free(*field);
+				*field = strdup(word);
+			}
+			else if (strcmp(key, "match") == 0)
+			{
+				editorSyntaxAddWord(&s->filematch, word, false);
+			}
+			else if (strcmp(key, "keywords") == 0 || strcmp(key, "types") == 0)
+			{
+				editorSyntaxAddWord(&s->keywords, word, key[0] == 't');
+			}
+		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	if (s->filetype == NULL || s->filematch[0] == NULL)
+	{
+		editorSyntaxFree(s);
+		return NULL;
+	}
+
+	return s;
 }
 
 /**
- *	editorRowInsertChar
+ *	editorSyntaxAddWord
  *
- *	@param row editor row
- *	@param at char position
- *	@param ch character
+ *	@param list NULL terminated list to grow, NULL to start one
+ *	@param word word to append, NULL to only start the list
+ *	@param type mark the word as a type keyword
  *
  */
-void editorRowInsertChar(erow *row, int at, int ch)
+void editorSyntaxAddWord(char ***list, const char *word, bool type)
 {
-	if (at < 0 || at > row->size)
+	char **new;
+	int n = 0;
+
+	while (*list != NULL && (*list)[n] != NULL)
 	{
-		at = row->size;
+		n++;
 	}
 
-	row->chars = realloc(row->chars, row->size + 2);
-	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-	row->size++;
-	row->chars[at] = ch;
-	editorUpdateRow(row);
-	editor.dirty++;
-}
+	new = realloc(*list, sizeof(char *) * (n + 2));
+	if (new == NULL)
+	{
+		die("realloc");
+	}
 
-/**
- *	editorInsertChar
- * 
- *	@param ch character
- *
- */
-void editorInsertChar(int ch)
-{
-	if (editor.cy == editor.numrows)
+	new[n] = NULL;
+	if (word != NULL)
 	{
-		editorInsertRow(editor.numrows, "", 0);
+		new[n] = malloc(strlen(word) + 2);
+		if (new[n] == NULL)
+		{
+			die("malloc");
+		}
+
+		sprintf(new[n], "%s%s", word, type ? "|" : "");
+		new[n + 1] = NULL;
 	}
 
-	editorRowInsertChar(&editor.row[editor.cy], editor.cx, ch);
-	editor.cx++;
+	*list = new;
 }
 
 /**
- *	editorRowDelChar
- * 
- *	@param row editor row
- *	@param at char position
+ *	editorSyntaxFree
+ *
+ *	@param s parsed definition that was never selected
  *
  */
-void editorRowDelChar(erow *row, int at)
+void editorSyntaxFree(struct editorSyntax *s)
 {
-	if (at < 0 || at >= row->size)
+	int i;
+
+	for (i = 0; s->filematch[i]; i++)
 	{
-		return;
+		free(s->filematch[i]);
 	}
-	else
+
+	for (i = 0; s->keywords[i]; i++)
 	{
-		memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-		row->size--;
-		editorUpdateRow(row);
-		editor.dirty++;
+		free(s->keywords[i]);
+	}
+
+	if (s->trie != NULL)
+	{
+		free(s->trie->trans);
+		free(s->trie->accept);
+		free(s->trie);
 	}
+
+	free(s->filematch);
+	free(s->keywords);
+	free(s->filetype);
+	free(s->singleline_comment_start);
+	free(s->multi_comment_start);
+	free(s->multi_comment_start2);
+	free(s->multi_comment_end);
+	free(s->lexer);
+	free(s);
 }
 
 /**
- *	editorDelChar
- * 
- *	@param none
+ *	editorSyntaxSerialize
+ *
+ *	@param ab set to the cache
+ *	@param syn parsed definitions
+ *	@param n number of definitions
+ *	@param nfiles number of definition files, for checking staleness
+ *	@param stamp newest change time of the files
  *
+ *	Compile each definition and lay the results out as a header, one
+ *	record per syntax, and the strings and tables the records point at by
+ *	offset
  */
-void editorDelChar(void)
+void editorSyntaxSerialize(struct abuf *ab, struct editorSyntax **syn, int n, int nfiles, long long stamp)
 {
-	erow *row = &editor.row[editor.cy];
-	if (editor.cy == editor.numrows)
-	{
-		return;
-	}
-	else if (editor.cx == 0 && editor.cy == 0)
-	{
-		return;
-	}
-	else
+	struct syntaxcache head;
+	struct syntaxrecord rec;
+	struct editorSyntax *s;
+	int i, j, nmatch, *matches;
+
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, SYNTAX_CACHE_MAGIC, sizeof(head.magic));
+	head.version = SYNTAX_CACHE_VERSION;
+	head.recsize = sizeof(struct syntaxrecord);
+	head.nsyntaxes = n;
+	head.nfiles = nfiles;
+	head.stamp = stamp;
+
+	abReserve(ab, sizeof(head) + n * sizeof(rec));
+	memset(ab->b, 0, sizeof(head) + n * sizeof(rec));
+	ab->len = sizeof(head) + n * sizeof(rec);
+
+	for (i = 0; i < n; i++)
 	{
-		if (editor.cx > 0)
+		s = syn[i];
+		s->trie = editorTrieCompile(s->keywords);
+		s->lexer = editorLexerCompile(s);
+
+		memset(&rec, 0, sizeof(rec));
+		for (nmatch = 0; s->filematch[nmatch]; nmatch++)
 		{
-			editorRowDelChar(row, editor.cx - 1);
-			editor.cx--;
 		}
-		else
+
+		matches = malloc(sizeof(int) * nmatch);
+		if (matches == NULL)
 		{
-			editor.cx = editor.row[editor.cy - 1].size;
-			editorRowAppendString(&editor.row[editor.cy - 1], row->chars, row->size);
-			editorDelRow(editor.cy);
-			editor.cy--;
+			die("malloc");
 		}
+
+		for (j = 0; j < nmatch; j++)
+		{
+			matches[j] = editorCacheData(ab, s->filematch[j], strlen(s->filematch[j]) + 1);
+		}
+
+		rec.filematch = editorCacheData(ab, matches, sizeof(int) * nmatch);
+		rec.nfilematch = nmatch;
+		free(matches);
+
+		rec.filetype = editorCacheData(ab, s->filetype, strlen(s->filetype) + 1);
+		rec.scs = editorCacheData(ab, s->singleline_comment_start, s->singleline_comment_start ? \
+			(int) strlen(s->singleline_comment_start) + 1 : 0);
+		rec.mcs = editorCacheData(ab, s->multi_comment_start, s->multi_comment_start ? \
+			(int) strlen(s->multi_comment_start) + 1 : 0);
+		rec.mcs2 = editorCacheData(ab, s->multi_comment_start2, s->multi_comment_start2 ? \
+			(int) strlen(s->multi_comment_start2) + 1 : 0);
+		rec.mce = editorCacheData(ab, s->multi_comment_end, s->multi_comment_end ? \
+			(int) strlen(s->multi_comment_end) + 1 : 0);
+		rec.flags = s->flags;
+		rec.nnodes = s->trie->nnodes;
+		rec.width = s->trie->width;
+		memcpy(rec.cls, s->trie->cls, sizeof(rec.cls));
+		rec.trans = editorCacheData(ab, s->trie->trans, sizeof(int) * s->trie->nnodes * s->trie->width);
+		rec.accept = editorCacheData(ab, s->trie->accept, s->trie->nnodes);
+		rec.lexer = *s->lexer;
+
+		memcpy(&ab->b[sizeof(head) + i * sizeof(rec)], &rec, sizeof(rec));
 	}
+
+	head.len = ab->len;
+	memcpy(ab->b, &head, sizeof(head));
 }
 
 /**
- *	editorRowsToString
- * 
- *	@param buflen length of string
+ *	editorCacheData
  *
+ *	@param ab cache being built
+ *	@param p bytes to append
+ *	@param len number of bytes, 0 for none
+ *
+ *	Offset of the bytes in the cache, aligned for ints; 0 when there are none
  */
-char *editorRowsToString(int *buflen)
+int editorCacheData(struct abuf *ab, const void *p, int len)
 {
-	int totlen = 0, j;
-	char *buf, *p;
+	int off;
 
-	for (j = 0; j > editor.numrows; j++)
+	if (len == 0)
 	{
-		totlen += editor.row[j].size + 1;
+		return 0;
 	}
 
-	*buflen = totlen;
-	buf = malloc(totlen);
-	p = buf;
-
-	for (j = 0; j < editor.numrows; j++)
+	while (ab->len % sizeof(int) != 0)
 	{
-		memcpy(p, editor.row[j].chars, editor.row[j].size);
-		p += editor.row[j].size;
-		*p = '\n';
-		p++;
+		abAppendByte(ab, '\0');
 	}
 
-	return buf;
+	off = ab->len;
+	abAppend(ab, p, len);
+
+	return off;
 }
 
 /**
- *	editorUpdateRow
+ *	editorCacheTable
  *
- *	@param row editor row
+ *	@param len size of the cache
+ *	@param off offset of the table
+ *	@param count number of entries
+ *	@param size size of an entry, also its alignment
  *
+ *	Whether a table of count entries at off lies inside the cache
  */
-void editorUpdateRow(erow *row)
+bool editorCacheTable(size_t len, int off, size_t count, size_t size)
+{
+	return off >= 0 && (size_t) off <= len && (size_t) off % size == 0 && count <= (len - off) / size;
+}
+
+/**
+ *	editorCacheString
+ *
+ *	@param base cache contents
+ *	@param len size of the cache
+ *	@param off offset of the string
+ *
+ *	Length of the string at off, or -1 unless its NUL is inside the cache
+ */
+ssize_t editorCacheString(const char *base, size_t len, int off)
 {
-	int j, idx = 0, tabs = 0;
+	const char *nul;
 
-	for (j = 0; j < row->size; j++)
+	if (off < 0 || (size_t) off >= len)
 	{
-		if (row->chars[j] == '\t')
-		{
-			tabs++;
-		}
+		return -1;
 	}
 
-	free(row->render);
-	row->render = malloc(row->size + tabs *(TAB_STOP - 1) + 1);
+	nul = memchr(base + off, '\0', len - off);
+
+	return (nul == NULL) ? -1 : nul - (base + off);
+}
 
-	for (j = 0; j < row->size; j++)
+/**
+ *	editorCacheDelim
+ *
+ *	@param base cache contents
+ *	@param len size of the cache
+ *	@param off offset of the delimiter, 0 for none
+ *	@param dlen length the lexer was built with
+ *
+ *	Whether an optional comment delimiter is inside the cache and as long
+ *	as the lexer expects
+ */
+bool editorCacheDelim(const char *base, size_t len, int off, int dlen)
+{
+	if (off == 0)
 	{
-		if (row->chars[j] == '\t')
-		{
-			row->render[idx++] = ' ';
-			while (idx % TAB_STOP != 0)
-			{
-				row->render[idx++] = ' ';
-			}
-		}
-		else
-		{
-			row->render[idx++] = row->chars[j];
-		}
+		return dlen == 0;
 	}
 
-	row->render[idx] = '\0';
-	row->rsize = idx;
-
-	editorUpdateSyntax(row);
+	return editorCacheString(base, len, off) == dlen;
 }
 
 /**
- *	editorSyntaxToColor
- * 
- *	@param hl highlight color value
+ *	editorSyntaxMap
  *
- *	@todo return ANSI color value
+ *	@param base cache contents, kept for the life of the editor
+ *	@param len size of the cache
+ *	@param nfiles number of definition files now
+ *	@param stamp newest change time of the files now
+ *
+ *	Point syntaxes straight at the tables in a cache and put the built in
+ *	ones after them. Returns -1 without touching anything if the cache is
+ *	from another version or older than the definitions.
  */
-int editorSyntaxToColor(int hl)
+int editorSyntaxMap(const char *base, size_t len, int nfiles, long long stamp)
 {
-	switch (hl)
+	const struct syntaxcache *head = (const struct syntaxcache *) base;
+	const struct syntaxrecord *rec = (const struct syntaxrecord *) (base + sizeof(struct syntaxcache));
+	const struct syntaxrecord *r;
+	struct editorSyntax *s;
+	struct kwtrie *tries;
+	char **matches;
+	const int *off, *trans;
+	int i, j, n, total = 0;
+	size_t k;
+
+	if (len < sizeof(*head) || memcmp(head->magic, SYNTAX_CACHE_MAGIC, sizeof(head->magic)) != 0 || \
+		head->version != SYNTAX_CACHE_VERSION || head->recsize != sizeof(struct syntaxrecord) || \
+		head->len != len || head->nfiles != nfiles || head->stamp != stamp || head->nsyntaxes < 0 || \
+		(size_t) head->nsyntaxes > (len - sizeof(*head)) / sizeof(*rec))
 	{
-		case HL_COMMENT:
-		case HL_MULTI_COMMENT:
-			{
-				return 36;
-			}
+		return -1;
+	}
 
-		case HL_STRING:
-			{
-				return 35;
-			}
+	// the file may be damaged, so every offset is checked before it is used
+	n = head->nsyntaxes;
+	for (i = 0; i < n; i++)
+	{
+		r = &rec[i];
+		if (r->nfilematch < 1 || r->nfilematch > INT_MAX - total - 1 || r->nnodes < 1 || r->width < 1 || \
+			(size_t) r->nnodes > SIZE_MAX / sizeof(int) / (size_t) r->width || \
+			!editorCacheTable(len, r->filematch, r->nfilematch, sizeof(int)) || \
+			!editorCacheTable(len, r->trans, (size_t) r->nnodes * r->width, sizeof(int)) || \
+			!editorCacheTable(len, r->accept, r->nnodes, 1) || \
+			editorCacheString(base, len, r->filetype) < 0 || \
+			!editorCacheDelim(base, len, r->scs, r->lexer.scs_len) || \
+			!editorCacheDelim(base, len, r->mcs, r->lexer.mcs_len) || \
+			!editorCacheDelim(base, len, r->mcs2, r->lexer.mcs2_len) || \
+			!editorCacheDelim(base, len, r->mce, r->lexer.mce_len))
+		{
+			return -1;
+		}
 
-		case HL_KEYWORD1:
+		off = (const int *) (base + r->filematch);
+		for (j = 0; j < r->nfilematch; j++)
+		{
+			if (editorCacheString(base, len, off[j]) < 0)
 			{
-				return 33;
+				return -1;
 			}
+		}
 
-		case HL_KEYWORD2:
+		// the trie indexes with these, so they must stay inside its tables
+		trans = (const int *) (base + r->trans);
+		for (k = 0; k < (size_t) r->nnodes * r->width; k++)
+		{
+			if (trans[k] < 0 || trans[k] >= r->nnodes)
 			{
-				return 32;
+				return -1;
 			}
+		}
 
-		case HL_NUMBER:
+		for (j = 0; j < 256; j++)
+		{
+			if (r->cls[j] >= r->width)
 			{
-				return 31;
+				return -1;
 			}
+		}
 
-		case HL_MATCH:
-			{
-				return 34;
-			}
+		total += r->nfilematch + 1;
+	}
 
-		default:
-			{
-				return 37;
-			}
+	editor.hldb = malloc(sizeof(struct editorSyntax) * (n + HLDB_ENTRIES));
+	tries = malloc(sizeof(struct kwtrie) * (n + 1));
+	matches = malloc(sizeof(char *) * (total + 1));
+	if (editor.hldb == NULL || tries == NULL || matches == NULL)
+	{
+		die("malloc");
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		s = &editor.hldb[i];
+		memset(s, 0, sizeof(*s));
+		s->filetype = (char *) base + rec[i].filetype;
+		s->filematch = matches;
+		off = (const int *) (base + rec[i].filematch);
+		for (j = 0; j < rec[i].nfilematch; j++)
+		{
+			*matches++ = (char *) base + off[j];
+		}
+
+		*matches++ = NULL;
+		s->singleline_comment_start = rec[i].scs ? (char *) base + rec[i].scs : NULL;
+		s->multi_comment_start = rec[i].mcs ? (char *) base + rec[i].mcs : NULL;
+		s->multi_comment_start2 = rec[i].mcs2 ? (char *) base + rec[i].mcs2 : NULL;
+		s->multi_comment_end = rec[i].mce ? (char *) base + rec[i].mce : NULL;
+		s->flags = rec[i].flags;
+
+		tries[i].nnodes = rec[i].nnodes;
+		tries[i].width = rec[i].width;
+		memcpy(tries[i].cls, rec[i].cls, sizeof(tries[i].cls));
+		tries[i].trans = (int *) (base + rec[i].trans);
+		tries[i].accept = (unsigned char *) base + rec[i].accept;
+		s->trie = &tries[i];
+		s->lexer = (struct lexer *) &rec[i].lexer;
 	}
+
+	memcpy(&editor.hldb[n], HLDB, sizeof(HLDB));
+	editor.nsyntaxes = n + HLDB_ENTRIES;
+
+	return 0;
 }
 
 /**
@@ -1877,12 +9383,14 @@ int editorSyntaxToColor(int hl)
  */
 void editorSelectSyntaxHighlight(void)
 {
-	int is_ext, filerow;
+	int is_ext;
 	unsigned int i;
 	struct editorSyntax * s;
 	char *ext;
 
 	editor.syntax = NULL;
+	editor.hl_gen++;
+	editor.hl_frontier = 0;
 	if (editor.filename == NULL)
 	{
 		return;
@@ -1891,9 +9399,9 @@ void editorSelectSyntaxHighlight(void)
 	{
 		ext = strrchr(editor.filename, '.');
 
-		for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+		for (int j = 0; j < editor.nsyntaxes; j++)
 		{
-			s = &HLDB[j];
+			s = &editor.hldb[j];
 			i = 0;
 
 			while (s->filematch[i])
@@ -1902,13 +9410,15 @@ void editorSelectSyntaxHighlight(void)
 				if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
 					(!is_ext && strstr(editor.filename, s->filematch[i])))
 				{
-					editor.syntax = s;
-
-					for (filerow = 0; filerow < editor.numrows; filerow++)
+					// compiled once, syntaxes live as long as the editor
+					if (s->trie == NULL)
 					{
-						editorUpdateSyntax(&editor.row[filerow]);
+						s->trie = editorTrieCompile(s->keywords);
+						s->lexer = editorLexerCompile(s);
 					}
 
+					editor.syntax = s;
+
 					return;
 				}
 
@@ -1918,6 +9428,297 @@ void editorSelectSyntaxHighlight(void)
 	}
 }
 
+/**
+ *	editorClock
+ *
+ *	@param none
+ *
+ *	Monotonic time in seconds
+ */
+double editorClock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ *	editorBench
+ *
+ *	@param filename file to measure with
+ *
+ *	Time the hot paths against a file on a fixed size screen without
+ *	touching the terminal. Each frame is a full repaint of one of the
+ *	first few pages, highlighted beforehand, so only drawing is measured.
+ *	Then search the whole file, and lex it with editorLexRow and the
+ *	bytewise reference.
+ */
+int editorBench(char *filename)
+{
+	struct abuf text = ABUF_INIT;
+	unsigned char *hl, *ref;
+	double start, elapsed;
+	size_t bytes = 0;
+	int i, pages, *offsets;
+	bool cached;
+	erow *row;
+
+	initEditor();
+	editor.screenrows = BENCH_ROWS;
+	editor.screencols = BENCH_COLS;
+	editorOpen(filename);
+
+	while (editor.loading)
+	{
+		editorUnlock();
+		usleep(1000);
+		editorLock();
+	}
+
+	pages = editor.numrows / BENCH_ROWS;
+	pages = (pages < 1) ? 1 : (pages > BENCH_PAGES) ? BENCH_PAGES : pages;
+	for (i = 0; i < pages; i++)
+	{
+		editor.rowoff = i * BENCH_ROWS;
+		editorFrameBegin();
+		editorDrawRows();
+	}
+
+	start = editorClock();
+	for (i = 0; i < BENCH_FRAMES; i++)
+	{
+		editor.rowoff = (i % pages) * BENCH_ROWS;
+		editor.frame.valid = false;
+		abReset(&editor.out);
+		editorCacheTrim();
+		editorFrameBegin();
+		editorDrawRows();
+		editorDrawStatusBar();
+		editorDrawMessageBar();
+		editorFrameFlush(&editor.out);
+		bytes += editor.out.len;
+	}
+
+	elapsed = editorClock() - start;
+	printf("draw: %d frames of %dx%d, %.1f us/frame, %zu bytes/frame, %.1f MB/s\n", \
+		BENCH_FRAMES, BENCH_COLS, BENCH_ROWS, elapsed / BENCH_FRAMES * 1e6, \
+		bytes / BENCH_FRAMES, bytes / elapsed / 1e6);
+
+	editorBenchSearch();
+
+	if (editor.syntax == NULL)
+	{
+		printf("highlight: no syntax for this file\n");
+		return 0;
+	}
+
+	// render every row up front so only lexing is timed
+	offsets = malloc(sizeof(int) * (editor.numrows + 1));
+	if (offsets == NULL)
+	{
+		die("malloc");
+	}
+
+	for (i = 0, row = editorRowAt(0); row != NULL; i++, row = editorRowNext(row))
+	{
+		cached = (row->render != NULL);
+		editorRowRender(row);
+		offsets[i] = text.len;
+		abAppend(&text, row->render, row->rsize + 1);
+		if (!cached)
+		{
+			editorRowDropCache(row);
+		}
+	}
+
+	offsets[i] = text.len;
+	hl = calloc(text.len + 1, 1);
+	ref = calloc(text.len + 1, 1);
+	if (hl == NULL || ref == NULL)
+	{
+		die("calloc");
+	}
+
+	pages = (text.len > 0 && text.len < BENCH_LEX_BYTES) ? BENCH_LEX_BYTES / text.len : 1;
+	elapsed = editorBenchLex(editorLexRow, text.b, offsets, i, hl, pages);
+	start = editorBenchLex(editorLexRowBytewise, text.b, offsets, i, ref, pages);
+	printf("highlight: %d rows, %.1f MB x %d, %.2f GB/s, bytewise %.2f GB/s, output %s\n", \
+		i, text.len / 1e6, pages, (double) text.len * pages / elapsed / 1e9, \
+		(double) text.len * pages / start / 1e9, memcmp(hl, ref, text.len) ? "differs" : "matches");
+
+	free(offsets);
+	free(hl);
+	free(ref);
+	abFree(&text);
+
+	return 0;
+}
+
+/**
+ *	editorBenchSearch
+ *
+ *	@param none
+ *
+ *	Time a search for text that isn't in the file, with and without case,
+ *	on one thread and on the worker pool, against rendering every row and
+ *	calling strstr on it as find used to. Patterns are timed too, one the
+ *	literal scanner can prefilter and one only the DFA can answer.
+ */
+void editorBenchSearch(void)
+{
+	struct matchset set = {NULL, 0, 0};
+	double start, exact, nocase, pool, rows, literal, dfa;
+	bool cached;
+	erow *row;
+
+	editorSearchCompile(BENCH_SEARCH_MISS);
+	editorSearchScan(0, editor.numrows, &set);
+	start = editorClock();
+	editorSearchScan(0, editor.numrows, &set);
+	exact = editorClock() - start;
+
+	editorSearchStart(0);
+	editorSearchWait();
+	start = editorClock();
+	editorSearchStart(0);
+	editorSearchWait();
+	pool = editorClock() - start;
+
+	editor.search.nocase = true;
+	editorSearchCompile(BENCH_SEARCH_MISS);
+	start = editorClock();
+	editorSearchScan(0, editor.numrows, &set);
+	nocase = editorClock() - start;
+	editor.search.nocase = false;
+
+	editor.search.regex = true;
+	editorSearchCompile(BENCH_REGEX_LITERAL);
+	start = editorClock();
+	editorSearchScan(0, editor.numrows, &set);
+	literal = editorClock() - start;
+
+	editorSearchCompile(BENCH_REGEX_DFA);
+	start = editorClock();
+	editorSearchScan(0, editor.numrows, &set);
+	dfa = editorClock() - start;
+	editor.search.regex = false;
+	editorRegexFree(&editor.search.re);
+	free(set.m);
+
+	start = editorClock();
+	for (row = editorRowAt(0); row != NULL; row = editorRowNext(row))
+	{
+		cached = (row->render != NULL);
+		editorRowRender(row);
+		if (strstr(row->render, BENCH_SEARCH_MISS) != NULL)
+		{
+			break;
+		}
+
+		if (!cached)
+		{
+			editorRowDropCache(row);
+		}
+	}
+
+	rows = editorClock() - start;
+	printf("search: miss over %.1f MB, %.2f GB/s, any case %.2f GB/s, per row strstr %.2f GB/s\n", \
+		editor.text.origlen / 1e6, editor.text.origlen / exact / 1e9, editor.text.origlen / nocase / 1e9, \
+		editor.text.origlen / rows / 1e9);
+	printf("search: %d threads %.2f GB/s, %.1fx one thread\n", editor.search.pool.nthreads, \
+		editor.text.origlen / pool / 1e9, exact / pool);
+	printf("search: regex with a literal %.2f GB/s, without %.2f GB/s\n", editor.text.origlen / literal / 1e9, \
+		editor.text.origlen / dfa / 1e9);
+}
+
+/**
+ *	editorBenchLex
+ *
+ *	@param lex lexer to time
+ *	@param text rendered rows, each NUL terminated
+ *	@param offsets start of each row in text, nrows + 1 entries
+ *	@param nrows number of rows
+ *	@param hl set to the highlight of text
+ *	@param passes times to lex the whole text
+ *
+ *	Seconds taken to lex every row in order, carrying state across rows
+ */
+double editorBenchLex(void (*lex)(struct editorSyntax *, const char *, int, unsigned char *, \
+	const struct lexstate *, struct lexstate *), const char *text, const int *offsets, int nrows, \
+	unsigned char *hl, int passes)
+{
+	struct lexstate state, out;
+	double start = editorClock();
+	int i, pass;
+
+	for (pass = 0; pass < passes; pass++)
+	{
+		memset(&state, 0, sizeof(state));
+		for (i = 0; i < nrows; i++)
+		{
+			lex(editor.syntax, &text[offsets[i]], offsets[i + 1] - offsets[i] - 1, &hl[offsets[i]], &state, &out);
+			state = out;
+		}
+	}
+
+	return editorClock() - start;
+}
+
+/**
+ *	editorCheck
+ *
+ *	@param none
+ *
+ *	Regression checks that need no terminal. A scratch file is edited
+ *	with a replace-all and saved over itself; undo must then give back
+ *	the text as first read, which only lived in the file that was just
+ *	replaced. Returns the exit status.
+ */
+int editorCheck(void)
+{
+	char path[] = CHECK_FILE, *buf;
+	size_t len;
+	bool ok;
+	int fd;
+
+	initEditor();
+	editor.screenrows = BENCH_ROWS;
+	editor.screencols = BENCH_COLS;
+
+	fd = mkstemp(path);
+	if (fd == -1 || !editorWriteAll(fd, CHECK_TEXT, strlen(CHECK_TEXT)) || close(fd) == -1)
+	{
+		die("check file");
+	}
+
+	editorOpen(path);
+	while (editor.loading)
+	{
+		editorUnlock();
+		usleep(1000);
+		editorLock();
+	}
+
+	editor.undo.key++;
+	editorSearchCompile("a");
+	editorReplaceAll("X");
+	editor.undo.key++;
+	editorSave();
+	editor.undo.key++;
+	editorUndo();
+
+	buf = editorRowsToString(&len);
+	ok = (len == strlen(CHECK_TEXT) && memcmp(buf, CHECK_TEXT, len) == 0);
+	printf("undo after save: %s\n", ok ? "restores the text" : "differs");
+
+	free(buf);
+	unlink(path);
+
+	return ok ? 0 : 1;
+}
+
 /*** main
  * 
  *	@param argc
@@ -1927,23 +9728,35 @@ void editorSelectSyntaxHighlight(void)
 
 int main(int argc, char *argv[])
 {
+	if (argc >= 3 && strcmp(argv[1], "--bench") == 0)
+	{
+		return editorBench(argv[2]);
+	}
+
+	if (argc >= 2 && strcmp(argv[1], "--check") == 0)
+	{
+		return editorCheck();
+	}
+
 	write(STDOUT_FILENO, "\x1b[2J", 4);
 	write(STDOUT_FILENO, "\x1b[H", 3);
 	enableRawMode();
 	initEditor();
+	editorEventInit();
+	editorHlStart();
+	editorUpdateWindowSize();
 
 	if (argc >= 2)
 	{
 		editorOpen(argv[1]);
 	}
 
-	editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+	editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-E = replace | Ctrl-Z/Y = undo/redo");
 
-	// infinite loop to read 1 from standard input
 	while (true)
 	{
 		editorRefreshScreen();
-		editorProcessKeypress();
+		editorProcessInput();
 	}
 
 	return 0;